@@ -1,10 +1,16 @@
+#include "au/AuAsyncWriter.h"
+#include "au/AuBatchWriter.h"
 #include "au/AuEncoder.h"
 #include "au/AuDecoder.h"
+#include "au/AuMultiProducerEncoder.h"
 
 #include <benchmark/benchmark.h>
 
+#include <mutex>
 #include <sstream>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 static void BM_FileByteSource(benchmark::State &state) {
   size_t buffSz = state.range(0);
@@ -76,7 +82,8 @@ static void BM_CharBufCreateAndCopy(benchmark::State &state) {
 BENCHMARK(BM_CharBufCreateAndCopy)->Range(1, 1<<8);
 
 
-static void BM_StringInternInsert(benchmark::State &state, bool force, size_t cnt = 1) {
+static void BM_StringInternInsert(benchmark::State &state,
+                                  std::optional<bool> force, size_t cnt = 1) {
   size_t elems = state.range(0);
   AuStringIntern stringIntern;
 
@@ -99,6 +106,38 @@ BENCHMARK_CAPTURE(BM_StringInternInsert, Forced_Short,   true,   1)->Range(1, 1<
 BENCHMARK_CAPTURE(BM_StringInternInsert, Forced_Long,    true,  25)->Range(1, 1<<16);
 BENCHMARK_CAPTURE(BM_StringInternInsert, Unforced_Short, false,  1)->Range(1, 1<<16);
 BENCHMARK_CAPTURE(BM_StringInternInsert, Unforced_Long,  false, 25)->Range(1, 1<<16);
+// Never-repeated strings, each of which the usage tracker has to count (and
+// evict), like UUIDs or timestamps.
+BENCHMARK_CAPTURE(BM_StringInternInsert, Tracked_Short,  std::optional<bool>(),  1)->Range(1, 1<<16);
+BENCHMARK_CAPTURE(BM_StringInternInsert, Tracked_Long,   std::optional<bool>(), 25)->Range(1, 1<<16);
+
+
+// Cycles through "distinct" strings in auto mode. With more than the tracker
+// holds, they're forgotten before they're seen often enough to be interned.
+static void BM_StringInternTrack(benchmark::State &state, size_t cnt) {
+  size_t distinct = state.range(0);
+  std::vector<std::string> vals;
+  for (size_t elem = 0; elem < distinct; ++elem) {
+    std::ostringstream os;
+    for (unsigned i = 0; i < cnt; ++i) {
+      os << "value_";
+    }
+    os << elem;
+    vals.push_back(os.str());
+  }
+  AuStringIntern stringIntern;
+
+  for (auto _ : state) {
+    for (auto &val : vals)
+      benchmark::DoNotOptimize(stringIntern.idx(val, std::optional<bool>()));
+    state.PauseTiming();
+    stringIntern.clear(false);
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * distinct);
+}
+BENCHMARK_CAPTURE(BM_StringInternTrack, Short,  1)->Range(1<<8, 1<<14);
+BENCHMARK_CAPTURE(BM_StringInternTrack, Long,  25)->Range(1<<8, 1<<14);
 
 
 static void BM_StringInternLookup(benchmark::State &state, bool force, size_t cnt = 1) {
@@ -121,5 +160,155 @@ BENCHMARK_CAPTURE(BM_StringInternLookup, Forced_Long,    true,  25)->Range(1, 1<
 BENCHMARK_CAPTURE(BM_StringInternLookup, Unforced_Short, false,  1)->Range(1, 1<<16);
 BENCHMARK_CAPTURE(BM_StringInternLookup, Unforced_Long,  false, 25)->Range(1, 1<<16);
 
+// A log line, as a service might write one from any of its threads
+static void logRecord(AuWriter &writer, size_t i) {
+  writer.map("ts", std::chrono::system_clock::time_point(), "thread", i % 16,
+             "level", "INFO", "message", "order accepted", "orderId", i,
+             "price", 101.25);
+}
+
+static ssize_t discard(std::string_view, std::string_view value) {
+  return static_cast<ssize_t>(value.size());
+}
+
+// The scalars records are mostly made of, written straight to a buffer
+static void BM_WriteScalars(benchmark::State &state) {
+  AuVectorBuffer buf(64 * 1024);
+  AuStringIntern stringIntern;
+  AuWriter writer(buf, stringIntern);
+  auto now = std::chrono::system_clock::now();
+  uint64_t i = 0;
+  for (auto _ : state) {
+    if (buf.tellp() > 60 * 1024) buf.clear();
+    writer.value(i * 977)
+        .value(-static_cast<int64_t>(i))
+        .value(static_cast<double>(i) / 3)
+        .value(now)
+        .value(std::string_view("a short string"), false)
+        .value(true);
+    i++;
+  }
+  state.SetItemsProcessed(state.iterations() * 6);
+}
+BENCHMARK(BM_WriteScalars);
+
+static void BM_EncodeRecord(benchmark::State &state) {
+  AuEncoder encoder;
+  size_t i = 0;
+  for (auto _ : state)
+    encoder.encode([&](AuWriter &writer) { logRecord(writer, i++); }, discard);
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_EncodeRecord);
+
+// A 15 field event, with its keys as strings
+static void eventRecord(AuWriter &writer, size_t i) {
+  writer.map("eventTime", i, "eventType", "fill", "symbol", "IBM",
+             "orderId", i, "clientOrderId", i + 1, "account", "ACCT01",
+             "side", "BUY", "price", 101.25, "quantity", 100,
+             "leavesQuantity", 0, "venue", "XNYS", "strategy", "twap",
+             "trader", "jsmith", "sequence", i, "latencyNanos", 1234);
+}
+
+// The same, with its keys as AuKeys
+static void eventRecordKeys(AuWriter &writer, size_t i) {
+  static constexpr AuKey EventTime("eventTime"), EventType("eventType"),
+      Symbol("symbol"), OrderId("orderId"), ClientOrderId("clientOrderId"),
+      Account("account"), Side("side"), Price("price"), Quantity("quantity"),
+      LeavesQuantity("leavesQuantity"), Venue("venue"), Strategy("strategy"),
+      Trader("trader"), Sequence("sequence"), LatencyNanos("latencyNanos");
+  writer.map(EventTime, i, EventType, "fill", Symbol, "IBM",
+             OrderId, i, ClientOrderId, i + 1, Account, "ACCT01",
+             Side, "BUY", Price, 101.25, Quantity, 100,
+             LeavesQuantity, 0, Venue, "XNYS", Strategy, "twap",
+             Trader, "jsmith", Sequence, i, LatencyNanos, 1234);
+}
+
+static void BM_EncodeEvent(benchmark::State &state,
+                           void (*record)(AuWriter &, size_t)) {
+  AuEncoder encoder;
+  size_t i = 0;
+  for (auto _ : state)
+    encoder.encode([&](AuWriter &writer) { record(writer, i++); }, discard);
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_CAPTURE(BM_EncodeEvent, StringKeys, eventRecord);
+BENCHMARK_CAPTURE(BM_EncodeEvent, AuKeys, eventRecordKeys);
+
+// Every thread encodes through one AuEncoder, under a lock
+static void BM_EncodeLocked(benchmark::State &state) {
+  static std::mutex mutex;
+  static AuEncoder encoder;
+  size_t i = 0;
+  for (auto _ : state) {
+    std::lock_guard<std::mutex> lock(mutex);
+    encoder.encode([&](AuWriter &writer) { logRecord(writer, i++); },
+                   discard);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_EncodeLocked)->ThreadRange(1, 16)->UseRealTime();
+
+// Every thread encodes through its own Producer, and thread 0 writes too
+static void BM_EncodeMultiProducer(benchmark::State &state) {
+  static AuMultiProducerEncoder encoder;
+  auto producer = encoder.producer();
+  size_t i = 0;
+  for (auto _ : state) {
+    producer.encode([&](AuWriter &writer) { logRecord(writer, i++); });
+    if (state.thread_index() == 0) encoder.drain(discard);
+  }
+  // every thread's loop has finished by now, so this empties the queue rather
+  // than leaving their last records to be drained in the next run's timing
+  if (state.thread_index() == 0) encoder.drain(discard);
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_EncodeMultiProducer)->ThreadRange(1, 16)->UseRealTime();
+
+// Writes each record to /dev/null as it's encoded, with a syscall apiece
+static void BM_EncodeWriteEach(benchmark::State &state) {
+  int fd = ::open("/dev/null", O_WRONLY);
+  AuEncoder encoder;
+  size_t i = 0;
+  for (auto _ : state) {
+    encoder.encode([&](AuWriter &writer) { logRecord(writer, i++); },
+                   [&](std::string_view dict, std::string_view value) {
+                     return ::write(fd, dict.data(), dict.size())
+                         + ::write(fd, value.data(), value.size());
+                   });
+  }
+  state.SetItemsProcessed(state.iterations());
+  ::close(fd);
+}
+BENCHMARK(BM_EncodeWriteEach);
+
+// Gathers records into a writev() to /dev/null per batch
+static void BM_EncodeBatchWriter(benchmark::State &state) {
+  int fd = ::open("/dev/null", O_WRONLY);
+  AuEncoder encoder;
+  AuBatchWriter writer(fd);
+  size_t i = 0;
+  for (auto _ : state)
+    encoder.encode([&](AuWriter &w) { logRecord(w, i++); }, writer);
+  writer.flush();
+  state.SetItemsProcessed(state.iterations());
+  ::close(fd);
+}
+BENCHMARK(BM_EncodeBatchWriter);
+
+// Leaves the writing to /dev/null to an AuAsyncWriter
+static void BM_EncodeAsyncWriter(benchmark::State &state) {
+  int fd = ::open("/dev/null", O_WRONLY);
+  AuEncoder encoder;
+  AuAsyncWriter writer(fd);
+  size_t i = 0;
+  for (auto _ : state)
+    encoder.encode([&](AuWriter &w) { logRecord(w, i++); }, writer);
+  writer.close();
+  state.SetItemsProcessed(state.iterations());
+  ::close(fd);
+}
+BENCHMARK(BM_EncodeAsyncWriter);
+
 
 BENCHMARK_MAIN();
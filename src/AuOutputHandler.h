@@ -1,5 +1,6 @@
 #pragma once
 
+#include "au/AuBatchWriter.h"
 #include "au/AuDecoder.h"
 #include "au/AuEncoder.h"
 #include "Dictionary.h"
@@ -10,18 +11,20 @@
 #include <iostream>
 #include <string_view>
 #include <vector>
+#include <unistd.h>
 
 class AuOutputHandler {
   AuEncoder encoder_;
-  std::vector<char> str_;
+  AuBatchWriter out_;
+  StringFragments str_;
 
   struct ValueHandler {
     AuWriter &writer_;
-    std::vector<char> &str_;
+    StringFragments &str_;
     Dictionary::Dict &dictionary_;
 
     ValueHandler(AuWriter &writer,
-                 std::vector<char> &str,
+                 StringFragments &str,
                  Dictionary::Dict &dictionary)
     : writer_(writer), str_(str), dictionary_(dictionary) {}
 
@@ -38,35 +41,35 @@ class AuOutputHandler {
       writer_.value(nanos);
     }
     void onDictRef(size_t, size_t idx) {
-      const auto &v = dictionary_.at(idx);
+      auto v = dictionary_.at(idx);
       writer_.value(v);
     }
     void onStringStart(size_t, size_t len) {
-      str_.clear();
-      str_.reserve(len);
+      str_.start(len);
     }
     void onStringEnd() {
-      writer_.value(std::string_view(str_.data(), str_.size()));
+      writer_.value(str_.view());
     }
     void onStringFragment(std::string_view frag) {
-      str_.insert(str_.end(), frag.data(), frag.data() + frag.size());
+      str_.append(frag);
     }
   };
 
 public:
   explicit AuOutputHandler(const std::string &metadata = "")
-  : encoder_(metadata, 250'000, 100) {
-    str_.reserve(1u << 16);
+  : encoder_(metadata, 250'000, 100), out_(STDOUT_FILENO) {
+    // what's already been written to std::cout has to come first
+    std::cout.flush();
   }
 
-  void onValue(FileByteSource &source, Dictionary::Dict &dictionary) {
+  /// Writes out the last of the records. Throws if that fails.
+  void flush() { out_.flush(); }
+
+  void onValue(FileByteSource &source, Dictionary::Dict &dictionary, size_t) {
     encoder_.encode([&] (AuWriter &writer) {
       ValueHandler handler(writer, str_, dictionary);
       ValueParser parser(source, handler);
       parser.value();
-    }, [] (std::string_view dict, std::string_view value) {
-      std::cout << dict << value; // TODO why use cout any longer?
-      return dict.size() + value.size(); // TODO need to check whether it was really written?
-    });
+    }, out_);
   }
 };
@@ -1,30 +1,28 @@
 #pragma once
 
 #include "Dictionary.h"
+#include "au/AuDecoder.h"
 #include "au/ParseError.h"
 
-#include <vector>
-
-class FileByteSource;
-
 template<typename ValueHandler>
 class AuRecordHandler {
   Dictionary &dictionary_;
   ValueHandler &valueHandler_;
-  std::vector<char> str_;
+  StringFragments str_;
   size_t sor_ = 0;
   Dictionary::Dict *dict_ = nullptr;
 
 public:
   AuRecordHandler(Dictionary &dictionary, ValueHandler &valueHandler)
-      : dictionary_(dictionary), valueHandler_(valueHandler) {
-    str_.reserve(1 << 16);
-  }
+      : dictionary_(dictionary), valueHandler_(valueHandler) {}
 
   void onRecordStart(size_t pos) {
     sor_ = pos;
   }
 
+  /// Start of the most recent record, e.g. the value record just parsed.
+  size_t recordPos() const { return sor_; }
+
   void onHeader(uint64_t, const std::string &) {}
 
   void onDictClear() {
@@ -32,26 +30,26 @@ public:
   }
 
   void onDictAddStart(size_t relDictPos) {
+    // a dictionary we already have this record's entries in, e.g. one loaded
+    // from an index, mustn't get them again, and neither must any other.
     auto &dictionary = dictionary_.findDictionary(sor_, relDictPos);
-    if (!dictionary.includes(sor_))
-      dict_ = &dictionary;
+    dict_ = dictionary.includes(sor_) ? nullptr : &dictionary;
   }
 
-  void onValue(size_t relDictPos, size_t, FileByteSource &source) {
+  void onValue(size_t relDictPos, size_t len, FileByteSource &source) {
     auto &dictionary = dictionary_.findDictionary(sor_, relDictPos);
-    valueHandler_.onValue(source, dictionary);
+    valueHandler_.onValue(source, dictionary, len);
   }
 
   void onStringStart(size_t, size_t len) {
-    str_.clear();
-    str_.reserve(len);
+    str_.start(len);
   }
 
   void onStringEnd() {
-    if (dict_) dict_->add(sor_, std::string_view(str_.data(), str_.size()));
+    if (dict_) dict_->add(sor_, str_.view());
   }
 
   void onStringFragment(std::string_view frag) {
-    str_.insert(str_.end(), frag.data(), frag.data() + frag.size());
+    str_.append(frag);
   }
 };
@@ -22,9 +22,9 @@ template<typename H>
 int doCat(const std::string &fileName, H &handler) {
   Dictionary dictionary;
   AuRecordHandler recordHandler(dictionary, handler);
-  FileByteSourceImpl source(fileName, false);
+  auto source = openFileByteSource(fileName, false, true, true);
   try {
-    RecordParser(source, recordHandler).parseStream();
+    RecordParser(*source, recordHandler).parseStream();
   } catch (const std::exception &e) {
     std::cerr << e.what() << " while processing " << fileName << "\n";
     return 1;
@@ -37,7 +37,9 @@ int catFile(const std::string &fileName, bool encodeOutput) {
     AuOutputHandler handler(
         STR("Re-encoded by au from original au file "
                 << (fileName == "-" ? "<stdin>" : fileName)));
-    return doCat(fileName, handler);
+    auto result = doCat(fileName, handler);
+    handler.flush();
+    return result;
   } else {
     JsonOutputHandler handler;
     return doCat(fileName, handler);
@@ -0,0 +1,273 @@
+#include "DictIndex.h"
+#include "AuRecordHandler.h"
+#include "MappedIndex.h"
+#include "au/AuCommon.h"
+#include "au/AuDecoder.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr auto Version = 1u;
+
+// the index is laid out as MappedIndex.h describes: a header, then each
+// dictionary's entries as of its last checkpoint, then the table of
+// checkpoints.
+constexpr char Magic[8] = {'a', 'u', 'd', 'x', 'b', 'i', 'n', '\n'};
+
+// the index is of the file if it has the same bytes here as when indexed
+constexpr size_t TailCheckLength = 4096;
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t entrySize; // sizeof(Entry)
+  uint64_t fileSize; // of the au file, as far as it was indexed
+  uint64_t tailHash; // of the TailCheckLength bytes before fileSize
+  uint64_t tableOffset; // aligned for Entry
+  uint64_t numEntries;
+};
+
+struct Entry {
+  uint64_t recordPos; // the start of a value record
+  uint64_t dictPos; // the start of the clear record of its dictionary
+  uint64_t lastDictPos; // the last record to add to the dictionary
+  uint64_t numStrings; // in the dictionary at recordPos
+  // the dictionary's entries, each a uint32_t length then the string, from the
+  // start of the index. a later checkpoint of the same dictionary has the same
+  // offset, and a greater length.
+  uint64_t stringsOffset;
+  uint64_t stringsLength;
+};
+
+static_assert(sizeof(Entry) == 48);
+
+std::optional<uint64_t> hashTail(int fd, uint64_t size) {
+  auto len = std::min<uint64_t>(size, TailCheckLength);
+  std::string buf(len, 0);
+  if (::pread(fd, buf.data(), len, size - len) != static_cast<ssize_t>(len))
+    return std::nullopt;
+  return fnv1a(buf);
+}
+
+std::string getIndexFilename(const std::string &filename,
+                             const std::optional<std::string> &indexFilename) {
+  if (indexFilename) return *indexFilename;
+  return filename + ".audx";
+}
+
+struct SkipValues {
+  void onValue(FileByteSource &source, Dictionary::Dict &, size_t len) {
+    source.skip(len);
+  }
+};
+
+/// Writes each dictionary's strings as the checkpoints come, and the table and
+/// then the header once all of them are known.
+class Writer {
+  MappedIndexWriter<Header, Entry> out_;
+  // the dictionary whose strings were written last, and how many of them
+  std::optional<size_t> dictPos_;
+  uint64_t stringsOffset_ = 0;
+  size_t written_ = 0;
+
+public:
+  explicit Writer(std::ostream &out) : out_(out, Magic, Version) {}
+
+  void checkpoint(size_t recordPos, const Dictionary::Dict &dict) {
+    if (dictPos_ != dict.startPos_) {
+      dictPos_ = dict.startPos_;
+      stringsOffset_ = out_.pos();
+      written_ = 0;
+    }
+    for (; written_ < dict.size(); written_++) {
+      auto str = dict.at(written_);
+      auto len = static_cast<uint32_t>(str.size());
+      out_.write(&len, sizeof(len));
+      out_.write(str.data(), str.size());
+    }
+    out_.add(Entry{recordPos, dict.startPos_, dict.lastDictPos_, dict.size(),
+                   stringsOffset_, out_.pos() - stringsOffset_});
+  }
+
+  size_t numEntries() const { return out_.numEntries(); }
+
+  void finish(uint64_t fileSize, uint64_t tailHash) {
+    out_.header.fileSize = fileSize;
+    out_.header.tailHash = tailHash;
+    out_.finish();
+  }
+};
+
+}
+
+int dictIndexFile(const std::string &fileName,
+                  const std::optional<std::string> &indexFilename,
+                  const DictIndexOptions &options) {
+  auto ifn = getIndexFilename(fileName, indexFilename);
+  std::cout << "Indexing " << fileName << " to " << ifn << "...\n";
+
+  FileByteSourceImpl source(fileName, false);
+  std::ofstream out(ifn, std::ios_base::binary | std::ios_base::trunc);
+  if (!out) {
+    std::cerr << "Unable to open output " << ifn << std::endl;
+    return 1;
+  }
+  Writer writer(out);
+
+  Dictionary dictionary;
+  SkipValues skipValues;
+  AuRecordHandler recordHandler(dictionary, skipValues);
+  RecordParser parser(source, recordHandler);
+  // the end of the last whole record. a file still being written to is
+  // indexed up to there.
+  size_t end = 0;
+  std::optional<size_t> next;
+  try {
+    while (parser.parseUntilValue()) {
+      auto sor = recordHandler.recordPos();
+      end = source.pos();
+      if (next && sor < *next) continue;
+      auto *dict = dictionary.latest();
+      if (!dict) THROW_RT("Value record at " << sor << " has no dictionary");
+      writer.checkpoint(sor, *dict);
+      next = sor + options.spacing;
+    }
+    end = source.pos();
+  } catch (parse_error &e) {
+    std::cerr << "Indexing only up to position " << end << ": " << e.what()
+              << std::endl;
+  }
+
+  int fd = ::open(fileName.c_str(), O_RDONLY);
+  auto tailHash = fd == -1 ? std::nullopt : hashTail(fd, end);
+  if (fd != -1) ::close(fd);
+  if (!tailHash) THROW_RT("Unable to read back " << fileName);
+  writer.finish(end, *tailHash);
+
+  std::cout << "Index complete: " << writer.numEntries() << " checkpoints.\n";
+  return 0;
+}
+
+class DictIndex::Impl {
+  MappedFile map_;
+  Header header_{};
+  const Entry *entries_ = nullptr;
+
+  const Entry *begin() const { return entries_; }
+  const Entry *end() const { return entries_ + header_.numEntries; }
+
+public:
+  Impl(const std::string &filename, int fd) : map_(fd, filename) {}
+
+  void validate(const std::string &filename) {
+    header_ = readIndexHeader<Header, Entry>(map_, Magic, Version, Version,
+                                             filename);
+    entries_ = indexTable<Entry>(map_, header_);
+    for (auto &entry : *this)
+      if (!inIndexData(header_, entry.stringsOffset, entry.stringsLength))
+        THROW_RT("Corrupt index: strings out of bounds");
+  }
+
+  bool isOf(int fd) const {
+    struct stat stat;
+    if (fstat(fd, &stat) < 0
+        || static_cast<uint64_t>(stat.st_size) < header_.fileSize)
+      return false;
+    return hashTail(fd, header_.fileSize) == header_.tailHash;
+  }
+
+  void load(Dictionary &dictionary, size_t pos) const {
+    auto it = std::upper_bound(
+        begin(), end(), pos,
+        [](size_t pos, const Entry &entry) { return pos < entry.recordPos; });
+    if (it == begin()) return;
+    auto &entry = *--it;
+
+    auto *dict = dictionary.search(entry.dictPos);
+    if (!dict) {
+      dict = &dictionary.clear(entry.dictPos);
+    } else if (dict->startPos_ != entry.dictPos
+               || dict->lastDictPos_ > entry.lastDictPos) {
+      return; // it's not this dictionary, or it's already got further
+    }
+
+    auto have = dict->size();
+    auto *str = map_.data() + entry.stringsOffset;
+    auto *stringsEnd = str + entry.stringsLength;
+    for (size_t i = 0; i < entry.numStrings; i++) {
+      uint32_t len;
+      if (stringsEnd - str < static_cast<ptrdiff_t>(sizeof(len)))
+        THROW_RT("Corrupt index: dictionary entry out of bounds");
+      memcpy(&len, str, sizeof(len));
+      str += sizeof(len);
+      if (static_cast<size_t>(stringsEnd - str) < len)
+        THROW_RT("Corrupt index: dictionary entry out of bounds");
+      if (i >= have) dict->add(entry.lastDictPos, std::string_view(str, len));
+      str += len;
+    }
+  }
+
+  std::vector<size_t> recordPositions() const {
+    std::vector<size_t> result;
+    for (auto &entry : *this) result.push_back(entry.recordPos);
+    return result;
+  }
+};
+
+DictIndex::DictIndex(std::unique_ptr<Impl> impl) : impl_(std::move(impl)) {}
+
+DictIndex::~DictIndex() {}
+
+std::unique_ptr<DictIndex> DictIndex::open(
+    const std::string &fileName,
+    const std::optional<std::string> &indexFilename) {
+  auto ifn = getIndexFilename(fileName, indexFilename);
+  int indexFd = ::open(ifn.c_str(), O_RDONLY);
+  if (indexFd == -1) {
+    if (indexFilename)
+      THROW_RT("open: " << strerror(errno) << " (" << ifn << ")");
+    return nullptr;
+  }
+  std::unique_ptr<Impl> impl;
+  try {
+    try {
+      impl = std::make_unique<Impl>(ifn, indexFd);
+    } catch (...) {
+      ::close(indexFd);
+      throw;
+    }
+    ::close(indexFd); // the mapping keeps its own reference to the file
+    impl->validate(ifn);
+  } catch (const std::exception &e) {
+    // the index only speeds things up, so a damaged one that was merely
+    // found lying next to the file mustn't stop it being read
+    if (indexFilename) throw;
+    std::cerr << "Ignoring " << ifn << ": " << e.what() << "\n";
+    return nullptr;
+  }
+
+  int fd = ::open(fileName.c_str(), O_RDONLY);
+  bool isOf = fd != -1 && impl->isOf(fd);
+  if (fd != -1) ::close(fd);
+  if (!isOf) {
+    std::cerr << "Ignoring " << ifn << ": it's not an index of " << fileName
+              << " as it is now\n";
+    return nullptr;
+  }
+  return std::unique_ptr<DictIndex>(new DictIndex(std::move(impl)));
+}
+
+void DictIndex::load(Dictionary &dictionary, size_t pos) const {
+  impl_->load(dictionary, pos);
+}
+
+std::vector<size_t> DictIndex::recordPositions() const {
+  return impl_->recordPositions();
+}
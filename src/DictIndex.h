@@ -0,0 +1,51 @@
+#pragma once
+
+#include "Dictionary.h"
+
+#include <memory>
+#include <optional>
+#include <string>
+
+/// How dictIndexFile() builds an index.
+struct DictIndexOptions {
+  static constexpr size_t DefaultSpacing = 1024 * 1024;
+
+  /// Most bytes between checkpoints. After a seek, at most this much of the
+  /// backref chain is left to follow from the checkpoint before it.
+  size_t spacing = DefaultSpacing;
+};
+
+/// Writes the DictIndex of an au file.
+int dictIndexFile(const std::string &fileName,
+                  const std::optional<std::string> &indexFilename,
+                  const DictIndexOptions &options);
+
+/// A sidecar index of an au file's dictionaries, <path>.audx. To decode a
+/// value record found by seeking, its dictionary has to be rebuilt by
+/// following the chain of backrefs through every dictionary add record back
+/// to the last clear. The index has checkpoints every so many bytes, each the
+/// start of a value record and the dictionary in force there, so the chain
+/// only needs following as far back as the checkpoint before the record.
+class DictIndex {
+  class Impl;
+  std::unique_ptr<Impl> impl_;
+
+  explicit DictIndex(std::unique_ptr<Impl> impl);
+public:
+  ~DictIndex();
+
+  /// The index of fileName, from indexFilename or else <fileName>.audx.
+  /// Returns null if there's no index, or it's not of this file. The file may
+  /// have been appended to since it was indexed. A corrupt index throws if it
+  /// was named explicitly, and is otherwise ignored, as if it weren't there.
+  static std::unique_ptr<DictIndex> open(
+      const std::string &fileName,
+      const std::optional<std::string> &indexFilename = std::nullopt);
+
+  /// Adds to dictionary whatever it lacks of the dictionary at the last
+  /// checkpoint before pos.
+  void load(Dictionary &dictionary, size_t pos) const;
+
+  /// Positions of the checkpoints' value records
+  std::vector<size_t> recordPositions() const;
+};
@@ -1,39 +1,72 @@
 #pragma once
 
+#include "au/AuStringStore.h"
 #include "au/ParseError.h"
 
-#include <string>
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <string_view>
 #include <vector>
 
 class Dictionary {
 public:
+  /// Computes flags for each entry as it's added, so that handlers can test a
+  /// property of an entry (e.g. "matches the grep pattern") with a bit test
+  /// instead of looking at the string again.
+  using Classifier = std::function<uint8_t(std::string_view)>;
+
   struct Dict {
-    std::vector<std::string> dictionary_;
+    AuStringStore dictionary_;
+    /// Flags for each entry. Lags dictionary_ when entries were added before
+    /// the classifier was set; flags() catches up.
+    std::vector<uint8_t> flags_;
+    uint8_t anyFlags_ = 0; //< Union of flags_
+    const Classifier *classifier_;
     size_t startPos_;
     size_t lastDictPos_;
 
-    Dict(size_t startPos)
-    : startPos_(startPos),
+    Dict(size_t startPos, const Classifier *classifier)
+    : classifier_(classifier),
+      startPos_(startPos),
       lastDictPos_(startPos) {
       dictionary_.reserve(1u << 16u);
     }
 
     void reset(size_t sor) {
       dictionary_.clear();
+      flags_.clear();
+      anyFlags_ = 0;
       startPos_ = sor;
       lastDictPos_ = sor;
     }
 
     void add(size_t sor, std::string_view value) {
-      dictionary_.emplace_back(value);
+      dictionary_.push_back(value);
+      if (*classifier_ && flags_.size() + 1 == dictionary_.size())
+        classifyNext();
       lastDictPos_ = sor;
     }
 
+    /// The classifier's flags for entry idx. Requires a classifier.
+    uint8_t flags(size_t idx) {
+      if (idx < flags_.size()) return flags_[idx];
+      at(idx);
+      while (flags_.size() <= idx) classifyNext();
+      return flags_[idx];
+    }
+
+    /// The union of the flags of all entries. Requires a classifier.
+    uint8_t anyFlags() {
+      while (flags_.size() < dictionary_.size()) classifyNext();
+      return anyFlags_;
+    }
+
     bool includes(size_t sor) const {
       return startPos_ <= sor && sor <= lastDictPos_;
     }
 
-    const std::string &at(size_t idx) const {
+    std::string_view at(size_t idx) const {
       if (idx >= dictionary_.size()) {
         THROW("Dictionary reference index "
                   << idx << " out of range. Dictionary started at position "
@@ -41,20 +74,55 @@ public:
                   << lastDictPos_ << ", and currently has "
                   << dictionary_.size() << " entries.");
       }
-      return dictionary_.at(idx);
+      return dictionary_[idx];
     }
-    const std::vector<std::string> &entries() const { return dictionary_; }
+    const AuStringStore &entries() const { return dictionary_; }
     size_t size() const { return dictionary_.size(); }
+
+  private:
+    void classifyNext() {
+      flags_.push_back((*classifier_)(dictionary_[flags_.size()]));
+      anyFlags_ |= flags_.back();
+    }
   };
 
 private:
-  std::vector<Dict> dictionaries_; // used as sort of a really dumb lru-cache
+  Classifier classifier_; // each Dict points at this, so we can't be moved
+  /// A ring of Dicts once there are maxDicts_ of them: clear() recycles the
+  /// oldest in place, keeping its storage.
+  std::vector<Dict> dictionaries_;
+  size_t newest_ = 0; //< Index in dictionaries_ of the latest Dict
+  std::vector<Dict *> byStart_; //< dictionaries_ in order of startPos_
   uint32_t maxDicts_;
 
+  void index(Dict &dict) {
+    auto it = std::upper_bound(
+        byStart_.begin(), byStart_.end(), dict.startPos_,
+        [](size_t pos, const Dict *dict) { return pos < dict->startPos_; });
+    byStart_.insert(it, &dict);
+  }
+
+  void unindex(Dict &dict) {
+    byStart_.erase(std::find(byStart_.begin(), byStart_.end(), &dict));
+  }
+
 public:
   Dictionary(uint32_t maxDicts = 1)
   : maxDicts_(maxDicts) {
     dictionaries_.reserve(maxDicts_);
+    byStart_.reserve(maxDicts_);
+  }
+
+  Dictionary(const Dictionary &) = delete;
+  Dictionary &operator=(const Dictionary &) = delete;
+
+  /// Sets the classifier for Dict::flags(), replacing any previous one.
+  void classify(Classifier classifier) {
+    classifier_ = std::move(classifier);
+    for (auto &dict : dictionaries_) {
+      dict.flags_.clear();
+      dict.anyFlags_ = 0;
+    }
   }
 
   Dict &clear(size_t sor) {
@@ -69,14 +137,15 @@ public:
     }
 
     if (dictionaries_.size() == maxDicts_) {
-      Dict dict(dictionaries_.front());
-      dictionaries_.erase(dictionaries_.begin());
-      dict.reset(sor);
-      dictionaries_.push_back(dict);
+      newest_ = (newest_ + 1) % maxDicts_;
+      unindex(dictionaries_[newest_]);
+      dictionaries_[newest_].reset(sor);
     } else {
-      dictionaries_.emplace_back(sor);
+      newest_ = dictionaries_.size();
+      dictionaries_.emplace_back(sor, &classifier_);
     }
-    return dictionaries_.back();
+    index(dictionaries_[newest_]);
+    return dictionaries_[newest_];
   }
 
   Dict &findDictionary(size_t sor, size_t relDictPos) {
@@ -93,16 +162,19 @@ public:
 
   Dict *latest() {
     if (dictionaries_.empty()) return nullptr;
-    return &dictionaries_.back();
+    return &dictionaries_[newest_];
   }
 
   Dict *search(size_t pos) {
-    // usually the one we want is the most recently added one... the other
-    // case is something like a bisect, in which case we don't mind scanning.
-    for (auto i = dictionaries_.size(); i-- > 0;) {
-      if (dictionaries_[i].includes(pos))
-        return &dictionaries_[i];
-    }
-    return nullptr;
+    // usually the one we want is the most recently added one. otherwise (e.g.
+    // when bisecting) it's the last one starting at or before pos, if any.
+    auto *dict = latest();
+    if (dict && dict->includes(pos)) return dict;
+    auto it = std::upper_bound(
+        byStart_.begin(), byStart_.end(), pos,
+        [](size_t pos, const Dict *dict) { return pos < dict->startPos_; });
+    if (it == byStart_.begin()) return nullptr;
+    dict = *--it;
+    return dict->includes(pos) ? dict : nullptr;
   }
 };
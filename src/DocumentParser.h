@@ -46,8 +46,8 @@ class DocumentParser {
       THROW_RT("Timestamps not supported in rapidjson document parser!");
     }
     void onDictRef(size_t, size_t idx) {
-      const auto &v = dict.at(idx);
-      doc->String(v.c_str(), static_cast<rapidjson::SizeType>(v.size()), true);
+      auto v = dict.at(idx);
+      doc->String(v.data(), static_cast<rapidjson::SizeType>(v.size()), true);
       count.back()++;
     }
 
@@ -74,7 +74,7 @@ public:
       THROW_RT("DocumentParser failed to parse value record!");
   }
 
-  void onValue(FileByteSource &source, const Dictionary::Dict &dict) {
+  void onValue(FileByteSource &source, const Dictionary::Dict &dict, size_t) {
     ValueHandler handler(source, dict);
     document_.Populate(handler);
   }
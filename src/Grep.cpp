@@ -1,10 +1,12 @@
 #include "main.h"
 #include "AuOutputHandler.h"
+#include "DictIndex.h"
 #include "JsonOutputHandler.h"
 #include "GrepHandler.h"
 #include "TclapHelper.h"
 #include "TimestampPattern.h"
 #include "Zindex.h"
+#include "ZstdByteSource.h"
 #include "au/AuDecoder.h"
 
 #include <chrono>
@@ -12,6 +14,8 @@
 #include <optional>
 #include <regex>
 
+#include <sys/stat.h>
+
 namespace {
 
 bool setSignedPattern(Pattern &pattern, std::string &intPat) {
@@ -77,26 +81,76 @@ bool setTimestampPattern(Pattern &pattern, const std::string &tsPat) {
   return true;
 }
 
+bool isRegularFile(const std::string &fileName) {
+  struct stat st;
+  return fileName != "-" && ::stat(fileName.c_str(), &st) == 0
+         && S_ISREG(st.st_mode);
+}
+
+/// What zgrep reads: a seekable zstd file, or else a gzipped one with an index
+std::unique_ptr<FileByteSource> openCompressed(
+    const std::string &fileName, const std::optional<std::string> &indexFile) {
+  if (ZstdByteSource::isSeekableZstd(fileName))
+    return std::make_unique<ZstdByteSource>(fileName);
+  return std::make_unique<ZipByteSource>(fileName, indexFile);
+}
+
+std::vector<size_t> compressedAccessPoints(
+    const std::string &fileName, const std::optional<std::string> &indexFile) {
+  if (ZstdByteSource::isSeekableZstd(fileName))
+    return ZstdByteSource(fileName).accessPoints();
+  return ZipByteSource(fileName, indexFile).accessPoints();
+}
+
 void grepFile(Pattern &pattern,
               const std::string &fileName,
               bool encodeOutput,
               bool compressed,
-              const std::optional<std::string> &indexFile) {
+              const std::optional<std::string> &indexFile,
+              uint32_t jobs) {
+  // an uncompressed file may have an index of its dictionaries, for seeking
+  std::unique_ptr<DictIndex> dictIndex;
+  if (!compressed && isRegularFile(fileName))
+    dictIndex = DictIndex::open(fileName, indexFile);
+
+  // the parallel search merges json output, but not au-encoded output whose
+  // dictionary depends on everything output before it.
+  if (jobs > 1 && !pattern.bisect && (!encodeOutput || pattern.count)) {
+    if (compressed) {
+      // each thread decompresses its own spans, starting at the index's
+      // access points (or, for zstd, at frame starts).
+      auto openSource = [&]() { return openCompressed(fileName, indexFile); };
+      auto accessPoints = compressedAccessPoints(fileName, indexFile);
+      doParallelGrep<JsonOutputHandler>(pattern, openSource, jobs,
+                                        accessPoints);
+      return;
+    }
+    if (isRegularFile(fileName)) {
+      auto openSource = [&]() {
+        return openFileByteSource(fileName, false, false, true);
+      };
+      doParallelGrep<JsonOutputHandler>(pattern, openSource, jobs, {},
+                                        dictIndex.get());
+      return;
+    }
+  }
+
   std::unique_ptr<FileByteSource> source;
   if (compressed) {
-    source.reset(new ZipByteSource(fileName, indexFile));
+    source = openCompressed(fileName, indexFile);
   } else {
-    source.reset(new FileByteSourceImpl(fileName, false));
+    source = openFileByteSource(fileName, false, !pattern.bisect, true);
   }
 
   if (encodeOutput) {
     AuOutputHandler handler(
         STR("Encoded by au: grep output from json file "
                 << (fileName == "-" ? "<stdin>" : fileName)));
-    doGrep(pattern, *source, handler);
+    doGrep(pattern, *source, handler, dictIndex.get());
+    handler.flush();
   } else {
     JsonOutputHandler handler;
-    doGrep(pattern, *source, handler);
+    doGrep(pattern, *source, handler, dictIndex.get());
   }
 }
 
@@ -124,7 +178,10 @@ void usage(const char *cmd) {
       << "  -A --after <n>      show <n> records of context after each match\n"
       << "  -C --context <n>    equivalent to -A n -B n\n"
       << "  -c --count          print count of matching records per file\n"
-      << "  -x --index <path>   use gzip index in <path> (only for zgrep)\n";
+      << "  -j --jobs <n>       search (and decompress, for zgrep) with <n> threads\n"
+      << "                      not for -o, or for -e without -c\n"
+      << "  -x --index <path>   use index in <path>: the gzip index for zgrep, or\n"
+      << "                      the dictionary index (see au index) for grep\n";
 }
 
 int grepCmd(int argc, const char * const *argv, bool compressed) {
@@ -144,6 +201,8 @@ int grepCmd(int argc, const char * const *argv, bool compressed) {
       "m", "matches", "matches", false, 0, "uint32_t", tclap.cmd());
   TCLAP::ValueArg<std::string> index(
       "x", "index", "index", false, "", "string", tclap.cmd());
+  TCLAP::ValueArg<uint32_t> jobs(
+      "j", "jobs", "jobs", false, 1, "uint32_t", tclap.cmd());
   TCLAP::SwitchArg encode("e", "encode", "encode", tclap.cmd());
   TCLAP::SwitchArg count("c", "count", "count", tclap.cmd());
   TCLAP::SwitchArg matchAtom("a", "atom", "atom", tclap.cmd());
@@ -241,13 +300,15 @@ int grepCmd(int argc, const char * const *argv, bool compressed) {
   pattern.count = count.isSet();
 
   std::optional<std::string> indexFile;
-  if (compressed && index.isSet()) indexFile = index.getValue();
+  if (index.isSet()) indexFile = index.getValue();
 
   if (fileNames.getValue().empty()) {
-    grepFile(pattern, "-", encode.isSet(), compressed, indexFile);
+    grepFile(pattern, "-", encode.isSet(), compressed, indexFile,
+             jobs.getValue());
   } else {
     for (auto &f : fileNames) {
-      grepFile(pattern, f, encode.isSet(), compressed, indexFile);
+      grepFile(pattern, f, encode.isSet(), compressed, indexFile,
+               jobs.getValue());
     }
   }
 
@@ -5,9 +5,17 @@
 #include "Tail.h"
 #include "TimestampPattern.h"
 
+#include <algorithm>
 #include <cassert>
 #include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <mutex>
 #include <optional>
+#include <sstream>
+#include <thread>
 #include <variant>
 
 struct Pattern {
@@ -87,6 +95,116 @@ struct Pattern {
   }
 };
 
+/**
+ * Decides from the raw bytes of a value record, without parsing it, that the
+ * record can't possibly match a Pattern, so that it can just be skipped. It
+ * errs on the side of "might match", in which case the record gets parsed.
+ *
+ * A string appears in a record either inline, as its own bytes, or as a
+ * reference to a dictionary entry, whose encoding we can look for instead.
+ * And all timestamps in a bounded range share their high-order bytes.
+ */
+class RecordPrefilter {
+public:
+  /// Dictionary::Dict flags, as set by GrepHandler's classifier.
+  enum Flags : uint8_t {
+    KeyMatch = 1u,
+    ValueMatch = 2u
+  };
+
+private:
+  /// A string the record must contain, inline or via the dictionary.
+  struct StringTerm {
+    std::string literal;
+    Flags flag; // dictionary entries which would match
+
+    StringTerm(std::string literal, Flags flag)
+        : literal(std::move(literal)), flag(flag) {}
+
+    bool isRef(Dictionary::Dict &dict, size_t idx) const {
+      return idx < dict.size() && (dict.flags(idx) & flag);
+    }
+
+    bool mightOccurIn(std::string_view raw, Dictionary::Dict &dict) const {
+      if (memmem(raw.data(), raw.size(), literal.data(), literal.size()))
+        return true;
+      if (!(dict.anyFlags() & flag)) return false;
+      // any byte could be part of some other value, so this finds false
+      // positives, but it can't miss a real reference.
+      for (size_t i = 0; i < raw.size(); i++) {
+        auto c = static_cast<uint8_t>(raw[i]);
+        if (c & 0x80u) {
+          if (isRef(dict, c & 0x7fu)) return true;
+        } else if (c == marker::DictRef) {
+          size_t idx = 0;
+          for (size_t j = i + 1, shift = 0; j < raw.size() && shift < 64;
+               j++, shift += 7) {
+            auto b = static_cast<uint8_t>(raw[j]);
+            idx |= static_cast<size_t>(b & 0x7fu) << shift;
+            if (!(b & 0x80u)) {
+              if (isRef(dict, idx)) return true;
+              break;
+            }
+          }
+        }
+      }
+      return false;
+    }
+  };
+
+  std::optional<StringTerm> key_;
+  std::optional<StringTerm> str_;
+  std::optional<std::string> timestampBytes_;
+  bool filterValues_ = false;
+
+public:
+  explicit RecordPrefilter(const Pattern &pattern) {
+    if (pattern.keyPattern)
+      key_.emplace(*pattern.keyPattern, KeyMatch);
+
+    // only strings and timestamps can be looked for in the raw bytes. other
+    // types have several encodings, and open-ended ranges can't be found at
+    // all. so any other kind of pattern means any record could match.
+    if (pattern.matchOrGreater || pattern.atomPattern || pattern.intPattern
+        || pattern.uintPattern || pattern.doublePattern)
+      return;
+    if (pattern.strPattern)
+      str_.emplace(pattern.strPattern->pattern, ValueMatch);
+    if (pattern.timestampPattern) {
+      using namespace std::chrono;
+      int64_t start = duration_cast<nanoseconds>(
+          pattern.timestampPattern->first.time_since_epoch()).count();
+      int64_t end = duration_cast<nanoseconds>(
+          pattern.timestampPattern->second.time_since_epoch()).count() - 1;
+      if (end < start || (start < 0 && end >= 0)) return;
+      auto s = static_cast<uint64_t>(start);
+      auto e = static_cast<uint64_t>(end);
+      size_t common = 0;
+      while (common < 8 && (s >> (56 - 8 * common)) == (e >> (56 - 8 * common)))
+        common++;
+      if (!common) return;
+      // timestamps are encoded little-endian, so the common high-order bytes
+      // are the last ones.
+      char bytes[sizeof(s)];
+      memcpy(bytes, &s, sizeof(s));
+      timestampBytes_.emplace(bytes + sizeof(s) - common, common);
+    }
+    filterValues_ = str_ || timestampBytes_;
+  }
+
+  bool enabled() const { return key_ || filterValues_; }
+
+  bool mightMatch(std::string_view raw, Dictionary::Dict &dict) const {
+    if (key_ && !key_->mightOccurIn(raw, dict)) return false;
+    if (!filterValues_) return true;
+    if (timestampBytes_ && memmem(raw.data(), raw.size(),
+                                  timestampBytes_->data(),
+                                  timestampBytes_->size()))
+      return true;
+    return str_ && str_->mightOccurIn(raw, dict);
+  }
+};
+
 /**
  * This ValueHandler looks for specific patterns, and if the pattern is found,
  * rewinds the data stream to the start of the record, then delegates to another
@@ -96,9 +214,10 @@ struct Pattern {
  */
 class GrepHandler {
   const Pattern &pattern_;
+  RecordPrefilter prefilter_;
 
-  std::vector<char> str_;
-  const Dictionary::Dict *dictionary_ = nullptr;
+  StringFragments str_;
+  Dictionary::Dict *dictionary_ = nullptr;
   bool matched_;
 
   // Keeps track of the context we're in so we know if the string we're
@@ -119,10 +238,16 @@ class GrepHandler {
   std::vector<ContextMarker> context_;
 
 public:
-  GrepHandler(const Pattern &pattern)
+  GrepHandler(const Pattern &pattern, Dictionary &dictionary)
       : pattern_(pattern),
+        prefilter_(pattern),
         matched_(false) {
-    str_.reserve(1<<16);
+    dictionary.classify([&pattern](std::string_view sv) {
+      uint8_t flags = 0;
+      if (pattern.matchesKey(sv)) flags |= RecordPrefilter::KeyMatch;
+      if (pattern.matchesValue(sv)) flags |= RecordPrefilter::ValueMatch;
+      return flags;
+    });
   }
 
   bool matched() const { return matched_; }
@@ -136,11 +261,19 @@ public:
     context_.back().counter++;
   }
 
-  void onValue(FileByteSource &source, const Dictionary::Dict &dict) {
+  void onValue(FileByteSource &source, Dictionary::Dict &dict, size_t len) {
+    matched_ = false;
+    if (prefilter_.enabled()) {
+      auto raw = source.peekBytes(len);
+      if (raw && !prefilter_.mightMatch(*raw, dict)) {
+        source.skip(len);
+        return;
+      }
+    }
+
     dictionary_ = &dict;
     context_.clear();
     context_.emplace_back(Context::BARE, 0, !pattern_.requiresKeyMatch());
-    matched_ = false;
     ValueParser<GrepHandler> parser(source, *this);
     parser.value();
   }
@@ -189,12 +322,15 @@ public:
   }
 
   void onDictRef(size_t, size_t dictIdx) {
-    // this could perhaps be optimized by indexing the dictionary as things are
-    // added and then just checking whether dictIdx refers to a known matching
-    // value. but, particularly since most dictionary entries and most patterns
-    // are very short strings, it's not clear whether that would be worth it.
-    // probably worth a try someday, but not essential...
-    checkString(dictionary_->at(dictIdx));
+    // the dictionary classified each entry against the pattern when it was
+    // added, so there's no need to look at the string again.
+    auto flags = dictionary_->flags(dictIdx);
+    if (isKey()) {
+      context_.back().checkVal = flags & RecordPrefilter::KeyMatch;
+    } else if (context_.back().checkVal
+               && (flags & RecordPrefilter::ValueMatch)) {
+      matched_ = true;
+    }
     incrCounter();
   }
 
@@ -220,12 +356,11 @@ public:
     if (!pattern_.strPattern
         && !(pattern_.requiresKeyMatch() && isKey()))
       return;
-    str_.clear();
-    str_.reserve(len);
+    str_.start(len);
   }
 
   void onStringEnd() {
-    checkString(std::string_view(str_.data(), str_.size()));
+    checkString(str_.view());
     incrCounter();
   }
 
@@ -233,7 +368,7 @@ public:
     if (!pattern_.strPattern
         && !(pattern_.requiresKeyMatch() && isKey()))
       return;
-    str_.insert(str_.end(), frag.data(), frag.data() + frag.size());
+    str_.append(frag);
   }
 
 private:
@@ -256,7 +391,7 @@ void reallyDoGrep(Pattern &pattern, Dictionary &dictionary,
                   FileByteSource &source, OutputHandler &handler) {
   if (pattern.count) pattern.beforeContext = pattern.afterContext = 0;
 
-  GrepHandler grepHandler(pattern);
+  GrepHandler grepHandler(pattern, dictionary);
   AuRecordHandler recordHandler(dictionary, grepHandler);
   AuRecordHandler outputRecordHandler(dictionary, handler);
   try {
@@ -296,6 +431,8 @@ void reallyDoGrep(Pattern &pattern, Dictionary &dictionary,
       } else if (force) {
         source.seek(posBuffer.back());
         RecordParser(source, outputRecordHandler).parseUntilValue();
+        // it's been output, so it mustn't be before-context again.
+        posBuffer.clear();
         force--;
       }
     }
@@ -308,9 +445,10 @@ void reallyDoGrep(Pattern &pattern, Dictionary &dictionary,
   }
 }
 
-void seekSync(FileByteSource &source, Dictionary &dictionary, size_t pos) {
+void seekSync(FileByteSource &source, Dictionary &dictionary, size_t pos,
+              const DictIndex *dictIndex) {
   source.seek(pos);
-  TailHandler tailHandler(dictionary, source);
+  TailHandler tailHandler(dictionary, source, dictIndex);
   if (!tailHandler.sync()) {
     THROW("Failed to find record at position " << pos);
   }
@@ -318,7 +456,7 @@ void seekSync(FileByteSource &source, Dictionary &dictionary, size_t pos) {
 
 template <typename OutputHandler>
 void doBisect(Pattern &pattern, FileByteSource &source,
-              OutputHandler &handler) {
+              OutputHandler &handler, const DictIndex *dictIndex) {
   constexpr size_t SCAN_THRESHOLD = 256 * 1024;
   constexpr size_t PREFIX_AMOUNT = 512 * 1024;
   // it's important that the suffix amount be large enough to cover the entire
@@ -335,7 +473,7 @@ void doBisect(Pattern &pattern, FileByteSource &source,
   bisectPattern.matchOrGreater = true;
 
   Dictionary dictionary(32);
-  GrepHandler grepHandler(bisectPattern);
+  GrepHandler grepHandler(bisectPattern, dictionary);
   AuRecordHandler recordHandler(dictionary, grepHandler);
 
   try {
@@ -344,14 +482,14 @@ void doBisect(Pattern &pattern, FileByteSource &source,
     while (end > start) {
       if (end - start <= SCAN_THRESHOLD) {
         seekSync(source, dictionary,
-                 start > PREFIX_AMOUNT ? start - PREFIX_AMOUNT : 0);
+                 start > PREFIX_AMOUNT ? start - PREFIX_AMOUNT : 0, dictIndex);
         pattern.scanSuffixAmount = SUFFIX_AMOUNT;
         reallyDoGrep(pattern, dictionary, source, handler);
         return;
       }
 
       size_t next = start + (end-start)/2;
-      seekSync(source, dictionary, next);
+      seekSync(source, dictionary, next, dictIndex);
 
       auto sor = source.pos();
       if (!RecordParser(source, recordHandler).parseUntilValue())
@@ -374,9 +512,9 @@ void doBisect(Pattern &pattern, FileByteSource &source,
 
 template <typename OutputHandler>
 void doGrep(Pattern &pattern, FileByteSource &source,
-            OutputHandler &handler) {
+            OutputHandler &handler, const DictIndex *dictIndex = nullptr) {
   if (pattern.bisect) {
-    doBisect(pattern, source, handler);
+    doBisect(pattern, source, handler, dictIndex);
     return;
   }
 
@@ -384,4 +522,277 @@ void doGrep(Pattern &pattern, FileByteSource &source,
   reallyDoGrep(pattern, dictionary, source, handler);
 }
 
+/**
+ * One byte range of a file being searched in parallel. The chunk owns the
+ * value records which start in [begin, end). Its worker finds them with
+ * TailHandler::sync(), just as tail does, and searches them like
+ * reallyDoGrep() would, keeping the output for the main thread to merge.
+ */
+struct GrepChunk {
+  struct Entry {
+    size_t pos;     //< Start of the value record
+    size_t ordinal; //< Index of the record within the chunk
+    bool match;
+    std::string text;
+  };
+
+  size_t begin;
+  size_t end;
+
+  std::optional<size_t> start; //< The first value record in the chunk
+  std::optional<size_t> stop;  //< The first value record after the chunk
+  size_t matches = 0;
+  /// Before-context for the first match which is in earlier chunks
+  size_t needBefore = 0;
+  /// Records to output, in order. After-context may run past stop.
+  std::vector<Entry> entries;
+  /// The chunk's last beforeContext records, for the next chunk's first match
+  std::vector<Entry> tail;
+  std::exception_ptr error;
+  bool done = false;
+
+  GrepChunk(size_t begin, size_t end) : begin(begin), end(end) {}
+};
+
+template <typename OutputHandler>
+void grepChunk(const Pattern &pattern, FileByteSource &source,
+               GrepChunk &chunk, const DictIndex *dictIndex) {
+  using Entry = GrepChunk::Entry;
+  Dictionary dictionary;
+  if (chunk.begin) {
+    // sync finds the record after the next RecordEnd, so start just before
+    // begin in case a record starts right on it.
+    source.seek(chunk.begin - std::min<size_t>(chunk.begin, 2));
+    TailHandler tailHandler(dictionary, source, dictIndex);
+    if (!tailHandler.sync()) return;
+  } else {
+    source.seek(0);
+  }
+  chunk.start = source.pos();
+
+  std::ostringstream out;
+  GrepHandler grepHandler(pattern, dictionary);
+  OutputHandler handler(out);
+  AuRecordHandler recordHandler(dictionary, grepHandler);
+  AuRecordHandler outputRecordHandler(dictionary, handler);
+  auto output = [&](size_t ordinal, bool match, std::vector<Entry> &to) {
+    RecordParser(source, outputRecordHandler).parseUntilValue();
+    to.push_back(Entry{outputRecordHandler.recordPos(), ordinal, match,
+                       out.str()});
+    out.str("");
+  };
+
+  const size_t before = pattern.beforeContext;
+  size_t numMatches = std::numeric_limits<size_t>::max();
+  if (pattern.numMatches) numMatches = *pattern.numMatches;
+  // (position, ordinal) of the records which are candidates for
+  // before-context, and of the chunk's latest records, for the tail.
+  std::vector<std::pair<size_t, size_t>> posBuffer;
+  std::vector<std::pair<size_t, size_t>> recent;
+  size_t force = 0;
+  for (size_t ordinal = 0; source.peek() != EOF; ordinal++) {
+    if (!force && chunk.matches >= numMatches) break;
+
+    if (posBuffer.size() == before + 1) posBuffer.erase(posBuffer.begin());
+    auto pos = source.pos();
+    posBuffer.emplace_back(pos, ordinal);
+    if (!RecordParser(source, recordHandler).parseUntilValue())
+      break;
+
+    bool ours = recordHandler.recordPos() < chunk.end;
+    if (!ours) {
+      // everything from here on belongs to the next chunk, except
+      // after-context for our last matches.
+      if (!chunk.stop) chunk.stop = recordHandler.recordPos();
+      if (!force) break;
+    } else if (before && !pattern.count) {
+      if (recent.size() == before) recent.erase(recent.begin());
+      recent.emplace_back(pos, ordinal);
+    }
+
+    if (ours && grepHandler.matched() && chunk.matches < numMatches) {
+      if (!chunk.matches) chunk.needBefore = before - std::min(before, ordinal);
+      chunk.matches++;
+      if (pattern.count) continue;
+      source.seek(posBuffer.front().first);
+      for (auto &p : posBuffer)
+        output(p.second, p.second == ordinal, chunk.entries);
+      posBuffer.clear();
+      force = pattern.afterContext;
+    } else if (force) {
+      source.seek(pos);
+      output(ordinal, false, chunk.entries);
+      posBuffer.clear();
+      force--;
+    }
+  }
+
+  if (!recent.empty()) {
+    source.seek(recent.front().first);
+    for (auto &p : recent) output(p.second, false, chunk.tail);
+  }
+}
+
+/**
+ * Searches a file with several threads, each searching its own chunks of the
+ * file with its own FileByteSource. The output is identical to
+ * reallyDoGrep()'s: the main thread merges the chunks in order, supplying
+ * context which crosses chunk boundaries and applying the -m limit across the
+ * whole file.
+ *
+ * @param openSource Makes a new seekable FileByteSource for the file.
+ * @param syncPoints If not empty, chunks start only at these positions, which
+ * should be ones that the source can seek to cheaply (e.g. zindex
+ * checkpoints). Otherwise they start anywhere.
+ * @param dictIndex If not null, the index of the file's dictionaries, used
+ * when syncing to the start of a chunk.
+ */
+template <typename OutputHandler, typename OpenSource>
+void doParallelGrep(const Pattern &origPattern, OpenSource openSource,
+                    size_t jobs, const std::vector<size_t> &syncPoints = {},
+                    const DictIndex *dictIndex = nullptr) {
+  constexpr size_t MIN_CHUNK_SIZE = 1 << 20;
+  constexpr size_t MAX_CHUNK_SIZE = 64 << 20;
+
+  Pattern pattern(origPattern);
+  if (pattern.count) pattern.beforeContext = pattern.afterContext = 0;
+
+  std::unique_ptr<FileByteSource> source = openSource();
+  auto fileEnd = source->endPos();
+  // several chunks per thread, so that they're kept evenly busy.
+  auto chunkSize = std::clamp(fileEnd / (jobs * 4),
+                              MIN_CHUNK_SIZE, MAX_CHUNK_SIZE);
+  std::vector<size_t> begins{0};
+  if (syncPoints.empty()) {
+    for (auto pos = chunkSize; pos < fileEnd; pos += chunkSize)
+      begins.push_back(pos);
+  } else {
+    // grepChunk() syncs from 2 bytes before the start of the chunk, so that
+    // it seeks right to the sync point.
+    for (auto point : syncPoints) {
+      if (point + 2 < fileEnd && point + 2 >= begins.back() + chunkSize)
+        begins.push_back(point + 2);
+    }
+  }
+  std::deque<GrepChunk> chunks;
+  for (size_t i = 0; i < begins.size(); i++)
+    chunks.emplace_back(begins[i],
+                        i + 1 < begins.size() ? begins[i + 1] : fileEnd);
+
+  // workers get only so far ahead of the output, bounding memory use
+  const size_t window = 2 * jobs;
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t next = 0;
+  size_t merged = 0;
+  bool cancelled = false;
+
+  auto work = [&]() {
+    std::unique_ptr<FileByteSource> src;
+    while (true) {
+      GrepChunk *chunk;
+      {
+        std::unique_lock lock(mutex);
+        cv.wait(lock, [&]() {
+          return cancelled || next >= chunks.size() || next < merged + window;
+        });
+        if (cancelled || next >= chunks.size()) return;
+        chunk = &chunks[next++];
+      }
+      try {
+        if (!src) src = openSource();
+        grepChunk<OutputHandler>(pattern, *src, *chunk, dictIndex);
+      } catch (...) {
+        chunk->error = std::current_exception();
+      }
+      {
+        std::unique_lock lock(mutex);
+        chunk->done = true;
+      }
+      cv.notify_all();
+    }
+  };
+
+  std::vector<std::thread> workers;
+  auto finish = [&]() {
+    {
+      std::unique_lock lock(mutex);
+      cancelled = true;
+    }
+    cv.notify_all();
+    for (auto &worker : workers) worker.join();
+    workers.clear();
+  };
+  for (size_t i = 0; i < jobs; i++) workers.emplace_back(work);
+
+  size_t numMatches = std::numeric_limits<size_t>::max();
+  if (pattern.numMatches) numMatches = *pattern.numMatches;
+  size_t total = 0;
+  std::optional<size_t> cutoff; // last ordinal of the final after-context
+  std::optional<size_t> lastOutput;
+  std::optional<size_t> prevStop;
+  std::deque<GrepChunk::Entry> tail;
+  auto emit = [&](const GrepChunk::Entry &entry) {
+    if (lastOutput && entry.pos <= *lastOutput) return;
+    std::cout << entry.text;
+    lastOutput = entry.pos;
+  };
+
+  try {
+    for (size_t k = 0; k < chunks.size() && total < numMatches; k++) {
+      GrepChunk *chunk = &chunks[k];
+      {
+        std::unique_lock lock(mutex);
+        cv.wait(lock, [&]() { return chunk->done; });
+      }
+      if (chunk->error) std::rethrow_exception(chunk->error);
+
+      if (prevStop && chunk->start != prevStop) {
+        // the worker synced somewhere other than where the previous chunk
+        // ended, e.g. on something which just looked like a record. the
+        // previous chunk's end is authoritative, so redo this one from there.
+        GrepChunk redo(*prevStop, chunk->end);
+        grepChunk<OutputHandler>(pattern, *source, redo, dictIndex);
+        *chunk = std::move(redo);
+      }
+      prevStop = chunk->stop;
+
+      if (pattern.count) {
+        total = std::min(numMatches, total + chunk->matches);
+      } else {
+        auto need = std::min<size_t>(chunk->needBefore, tail.size());
+        for (auto i = tail.size() - need; i < tail.size(); i++) emit(tail[i]);
+        for (auto &entry : chunk->entries) {
+          if (cutoff && entry.ordinal > *cutoff) break;
+          emit(entry);
+          if (entry.match && !cutoff && ++total == numMatches)
+            cutoff = entry.ordinal + pattern.afterContext;
+        }
+        for (auto &entry : chunk->tail) tail.push_back(std::move(entry));
+        while (tail.size() > pattern.beforeContext) tail.pop_front();
+      }
+
+      {
+        std::unique_lock lock(mutex);
+        merged = k + 1;
+        chunk->entries.clear();
+        chunk->entries.shrink_to_fit();
+        chunk->tail.clear();
+      }
+      cv.notify_all();
+    }
+    finish();
+
+    if (pattern.count) {
+      std::cout << total << std::endl;
+    }
+  } catch (parse_error &e) {
+    finish();
+    std::cerr << e.what() << std::endl;
+  } catch (...) {
+    finish();
+    throw;
+  }
+}
+
 }
@@ -0,0 +1,51 @@
+#include "DictIndex.h"
+#include "TclapHelper.h"
+
+namespace {
+
+void usage() {
+  std::cout
+      << "usage: au index [options] [--] <path>\n"
+      << "\n"
+      << " Builds an index of the dictionaries of an au file, so that au grep -o\n"
+      << " and au tail can load the dictionary at any point in it in one go\n"
+      << " rather than rebuilding it record by record. Writes index to\n"
+      << " <path>.audx. The index stays good as the file is appended to.\n"
+      << "\n"
+      << "  -h --help          show usage and exit\n"
+      << "  -x --index <path>  write index to <path> (defaults to inputpath.au.audx)\n"
+      << "  -s --spacing <n>   checkpoint every <n> bytes (default 1M). <n> may\n"
+      << "                     end in K, M or G. the closer they are, the less\n"
+      << "                     there is to rebuild after a seek\n";
+}
+
+}
+
+int dictIndex(int argc, const char * const *argv) {
+  TclapHelper tclap(usage);
+
+  TCLAP::UnlabeledValueArg<std::string> path(
+      "path", "", true, "", "path", tclap.cmd());
+  TCLAP::ValueArg<std::string> index(
+      "x", "index", "index", false, "", "string", tclap.cmd());
+  TCLAP::ValueArg<std::string> spacing(
+      "s", "spacing", "spacing", false, "", "string", tclap.cmd());
+
+  if (!tclap.parse(argc, argv)) return 1;
+
+  std::optional<std::string> indexFile;
+  if (index.isSet()) indexFile = index.getValue();
+
+  DictIndexOptions options;
+  if (spacing.isSet()) {
+    auto bytes = parseSize(spacing.getValue());
+    if (!bytes) {
+      std::cerr << "-s specified, but '" << spacing.getValue()
+                << "' is not a size." << std::endl;
+      return 1;
+    }
+    options.spacing = *bytes;
+  }
+
+  return dictIndexFile(path.getValue(), indexFile, options);
+}
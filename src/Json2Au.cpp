@@ -1,19 +1,23 @@
+#include "au/AuBatchWriter.h"
 #include "au/AuEncoder.h"
 #include "au/ParseError.h"
 #include "TclapHelper.h"
 #include "TimestampPattern.h"
+#include "Zindex.h"
 
 #include <rapidjson/document.h>
 #include <rapidjson/error/en.h>
 #include <rapidjson/filereadstream.h>
 #include <rapidjson/reader.h>
 
+#include <cerrno>
 #include <chrono>
-#include <fstream>
+#include <fcntl.h>
 #include <iostream>
 #include <stdio.h>
 #include <string>
 #include <string.h>
+#include <unistd.h>
 
 using namespace rapidjson;
 
@@ -137,8 +141,9 @@ public:
   }
 };
 
+template <typename W>
 ssize_t encodeFile(const std::string &inFName,
-                   std::ostream &out,
+                   W &&write,
                    size_t maxEntries,
                    bool quiet) {
   FILE *inF;
@@ -174,10 +179,7 @@ ssize_t encodeFile(const std::string &inFName,
                                        kParseFullPrecisionFlag +
                                        kParseNanAndInfFlag;
       res = reader.Parse<parseOpt>(in, handler);
-    }, [&](std::string_view dict, std::string_view value) {
-      out << dict << value; // TODO why use iostreams any longer?
-      return dict.size() + value.size();  // TODO need to check whether it was really written?
-    });
+    }, write);
 
     entriesProcessed++;
     if (!quiet && entriesProcessed % 10'000 == 0) {
@@ -226,6 +228,8 @@ void usage() {
     << "\n"
     << "  -h --help           show usage and exit\n"
     << "  -o --output <path>  output to file\n"
+    << "  -z --gzip           gzip the output as it's written, indexing it for\n"
+    << "                      zgrep in <path>.auzx. requires -o\n"
     << "  -q --quiet          do not print encoding statistics to stderr\n"
     << "  -c --count <count>  stop after encoding <count> records.\n";
 }
@@ -241,6 +245,7 @@ int json2au(int argc, const char * const *argv) {
       "c", "count", "count", false, std::numeric_limits<size_t>::max(),
       "size_t", tclap.cmd());
   TCLAP::SwitchArg quiet("q", "quiet", "quiet", tclap.cmd(), false);
+  TCLAP::SwitchArg gzip("z", "gzip", "gzip", tclap.cmd(), false);
   TCLAP::UnlabeledMultiArg<std::string> fileNames(
       "fileNames", "", false, "filename", tclap.cmd());
 
@@ -253,27 +258,47 @@ int json2au(int argc, const char * const *argv) {
   if (fileNames.isSet()) inputFiles = fileNames.getValue();
 
 
-  std::streambuf *outBuf;
-  std::ofstream outFileStream;
-  if (outFName == "-") {
-    outBuf = std::cout.rdbuf();
-  } else {
-    outFileStream.open(outFName, std::ios_base::binary);
-    if (!outFileStream) {
-      std::cerr << "Unable to open output " << outFName << std::endl;
+  auto encodeFiles = [&](auto &&write) {
+    for (const auto &f : inputFiles) {
+      auto result = encodeFile(f, write, maxEntries, quiet.isSet());
+      if (result == -1) break;
+      maxEntries -= result;
+    }
+  };
+
+  if (gzip.isSet()) {
+    if (outFName == "-") {
+      std::cerr << "-z requires -o, to know where to write the index."
+                << std::endl;
       return 1;
     }
-    outBuf = outFileStream.rdbuf();
+    ZipWriter zipWriter(outFName, std::nullopt, ZindexOptions());
+    encodeFiles([&](std::string_view dict, std::string_view value) {
+      zipWriter.write(dict);
+      zipWriter.write(value);
+      return dict.size() + value.size();
+    });
+    zipWriter.close();
+    return 0;
   }
-  std::ostream out(outBuf);
 
-  for (const auto &f : inputFiles) {
-    auto result = encodeFile(f, out, maxEntries, quiet.isSet());
-    if (result == -1) break;
-    maxEntries -= result;
+  int fd = STDOUT_FILENO;
+  if (outFName != "-") {
+    fd = ::open(outFName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+      std::cerr << "Unable to open output " << outFName << std::endl;
+      return 1;
+    }
+  }
+  AuBatchWriter writer(fd);
+  encodeFiles(writer);
+  writer.flush();
+  // remote filesystems may only report a failed write here
+  if (fd != STDOUT_FILENO && ::close(fd) != 0) {
+    std::cerr << "Unable to write to " << outFName << ": " << strerror(errno)
+              << std::endl;
+    return 1;
   }
-
-  // no need to explicitly close outFileStream
   return 0;
 }
 
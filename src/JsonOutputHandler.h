@@ -21,7 +21,7 @@
 
 class JsonOutputHandler {
   rapidjson::StringBuffer buffer_;
-  std::vector<char> str_;
+  StringFragments str_;
   struct RawDecode {
     typedef char Ch;
     static constexpr bool supportUnicode = false;
@@ -46,15 +46,15 @@ class JsonOutputHandler {
   };
   OurWriter writer_;
   Dictionary::Dict *dictionary_ = nullptr;
+  std::ostream &out_;
 
 public:
-  explicit JsonOutputHandler()
+  explicit JsonOutputHandler(std::ostream &out = std::cout)
       : buffer_(nullptr, 1u << 16),
-        writer_(buffer_) {
-    str_.reserve(1u << 16);
-  }
+        writer_(buffer_),
+        out_(out) {}
 
-  void onValue(FileByteSource &source, Dictionary::Dict &dictionary) {
+  void onValue(FileByteSource &source, Dictionary::Dict &dictionary, size_t) {
     buffer_.Clear();
     writer_.Reset(buffer_);
     dictionary_ = &dictionary;
@@ -65,7 +65,7 @@ public:
             " au value!");
     }
     if (buffer_.GetSize()) {
-      std::cout
+      out_
           << std::string_view(buffer_.GetString(), buffer_.GetSize())
           << std::endl;
     }
@@ -95,11 +95,12 @@ public:
     auto s = duration_cast<seconds>(nanos); // Because to_time_t might round
     auto tp = time_point<Clock, seconds>(s);
     std::time_t tt = system_clock::to_time_t(tp);
-    std::tm *tm = gmtime(&tt);
+    std::tm tm;
+    gmtime_r(&tt, &tm); // not gmtime: grep -j formats on several threads
 
     //                   12345678901234567890123456
     char strTime[sizeof("yyyy-mm-ddThh:mm:ss.mmmuuunnn")];
-    strftime(strTime, 21, "%FT%T.", tm);
+    strftime(strTime, 21, "%FT%T.", &tm);
 
     // Isolate the sub-second (fractional portion)
     auto fraction = duration_cast<nanoseconds>(nanos - s);
@@ -109,21 +110,21 @@ public:
   }
 
   void onDictRef(size_t, size_t idx) {
-    const auto &v = dictionary_->at(idx);
-    writer_.String(v.c_str(), static_cast<rapidjson::SizeType>(v.size()));
+    auto v = dictionary_->at(idx);
+    writer_.String(v.data(), static_cast<rapidjson::SizeType>(v.size()));
   }
 
   void onStringStart(size_t, size_t len) {
-    str_.clear();
-    str_.reserve(len);
+    str_.start(len);
   }
 
   void onStringEnd() {
-    writer_.String(str_.data(), static_cast<rapidjson::SizeType>(str_.size()));
+    auto sv = str_.view();
+    writer_.String(sv.data(), static_cast<rapidjson::SizeType>(sv.size()));
   }
 
   void onStringFragment(std::string_view frag) {
-    str_.insert(str_.end(), frag.data(), frag.data() + frag.size());
+    str_.append(frag);
   }
 
   std::string str() {
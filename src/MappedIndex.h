@@ -0,0 +1,161 @@
+#pragma once
+
+#include "au/ParseError.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <utility>
+#include <vector>
+
+// zindex's and the dictionary index's binary formats are both laid out to be
+// used in place: a Header, then whatever the entries refer to, then the table
+// of Entries, aligned so that the reader can binary-search it where it lies in
+// an mmap of the index. everything is in the host's byte order, so for now an
+// index is only readable where it was written.
+//
+// a Header starts with these fields, followed by any of its own:
+//   char magic[8];
+//   uint32_t version;
+//   uint32_t entrySize; // sizeof(Entry)
+// and has these somewhere:
+//   uint64_t tableOffset; // aligned for Entry
+//   uint64_t numEntries;
+
+/// Writes an index: the header, as a placeholder, then whatever write() is
+/// given, then on finish() the table of whatever add() was given, and the
+/// header again now that all of it is known.
+template <typename Header, typename Entry>
+class MappedIndexWriter {
+  std::ostream &out_;
+  std::vector<Entry> entries_;
+  uint64_t pos_ = 0;
+
+public:
+  /// Fill in the rest before finish()
+  Header header;
+
+  MappedIndexWriter(std::ostream &out, const char (&magic)[8],
+                    uint32_t version)
+      : out_(out) {
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, magic, sizeof(header.magic));
+    header.version = version;
+    header.entrySize = sizeof(Entry);
+    write(&header, sizeof(header));
+  }
+
+  /// Offset from the start of the index of the next byte written
+  uint64_t pos() const { return pos_; }
+
+  void write(const void *data, size_t len) {
+    out_.write(static_cast<const char *>(data), len);
+    pos_ += len;
+  }
+
+  void add(const Entry &entry) { entries_.push_back(entry); }
+
+  size_t numEntries() const { return entries_.size(); }
+
+  void finish() {
+    static const char padding[alignof(Entry)] = {};
+    write(padding, -pos_ % alignof(Entry));
+    header.tableOffset = pos_;
+    header.numEntries = entries_.size();
+    write(entries_.data(), entries_.size() * sizeof(Entry));
+    out_.seekp(0);
+    out_.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out_.flush();
+    if (!out_) THROW_RT("Unable to write index");
+  }
+};
+
+/// A read-only mapping of the whole of a file, or nothing if it's empty.
+class MappedFile {
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+
+public:
+  MappedFile() = default;
+
+  /// The fd can be closed afterwards: the mapping keeps its own reference.
+  MappedFile(int fd, const std::string &filename) {
+    struct stat stat;
+    if (fstat(fd, &stat) < 0)
+      THROW_RT("failed to stat index: " << strerror(errno));
+    size_ = static_cast<size_t>(stat.st_size);
+    if (!size_) return;
+    auto *addr = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED)
+      THROW_RT("mmap: " << strerror(errno) << " (" << filename << ")");
+    data_ = static_cast<const char *>(addr);
+  }
+
+  ~MappedFile() {
+    if (data_) ::munmap(const_cast<char *>(data_), size_);
+  }
+
+  MappedFile(MappedFile &&other) noexcept
+      : data_(other.data_), size_(other.size_) {
+    other.data_ = nullptr;
+    other.size_ = 0;
+  }
+
+  MappedFile &operator=(MappedFile &&other) noexcept {
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    return *this;
+  }
+
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+
+  bool startsWith(const char (&magic)[8]) const {
+    return size_ >= sizeof(magic) && !memcmp(data_, magic, sizeof(magic));
+  }
+};
+
+/// The header of an index written by MappedIndexWriter, once it's been checked
+/// to be one, of a version we read, with its table inside the file.
+template <typename Header, typename Entry>
+Header readIndexHeader(const MappedFile &map, const char (&magic)[8],
+                       uint32_t minVersion, uint32_t maxVersion,
+                       const std::string &filename) {
+  Header header;
+  if (map.size() < sizeof(header))
+    THROW_RT("Truncated index header in " << filename);
+  memcpy(&header, map.data(), sizeof(header));
+  if (memcmp(header.magic, magic, sizeof(header.magic)))
+    THROW_RT(filename << " is not the expected kind of index");
+  if (header.version < minVersion || header.version > maxVersion) {
+    if (minVersion == maxVersion)
+      THROW_RT("Wrong version index, expected version " << maxVersion);
+    THROW_RT("Wrong version index, expected version " << minVersion << " to "
+             << maxVersion);
+  }
+  if (header.entrySize != sizeof(Entry))
+    THROW_RT("Wrong index entry size " << header.entrySize);
+  if (header.tableOffset % alignof(Entry)
+      || header.tableOffset > map.size()
+      || header.numEntries
+             > (map.size() - header.tableOffset) / sizeof(Entry))
+    THROW_RT("Corrupt index: table out of bounds");
+  return header;
+}
+
+/// The table of entries of an index whose header readIndexHeader() returned
+template <typename Entry, typename Header>
+const Entry *indexTable(const MappedFile &map, const Header &header) {
+  return reinterpret_cast<const Entry *>(map.data() + header.tableOffset);
+}
+
+/// Whether len bytes at offset lie between the header and the table
+template <typename Header>
+bool inIndexData(const Header &header, uint64_t offset, uint64_t len) {
+  return offset >= sizeof(Header) && offset <= header.tableOffset
+      && len <= header.tableOffset - offset;
+}
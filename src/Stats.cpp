@@ -139,7 +139,7 @@ void dictStats(const Dictionary::Dict &dictionary,
               << byFreq[i].second << '\n';
 }
 
-struct StatsValueHandler : public NoopValueHandler {
+struct StatsValueHandler : public NoopValueHandler<StatsValueHandler> {
   std::vector<size_t> &dictFrequency;
   const Dictionary::Dict *dictionary = nullptr;
   size_t doubles = 0;
@@ -160,7 +160,7 @@ struct StatsValueHandler : public NoopValueHandler {
   StatsValueHandler(std::vector<size_t> &dictFrequency)
       : dictFrequency(dictFrequency) {}
 
-  void onValue(FileByteSource &source, const Dictionary::Dict &dict) {
+  void onValue(FileByteSource &source, const Dictionary::Dict &dict, size_t) {
     dictionary = &dict;
     source_ = &source;
     ValueParser<StatsValueHandler> parser(source, *this);
@@ -168,25 +168,25 @@ struct StatsValueHandler : public NoopValueHandler {
     source_ = nullptr;
   }
 
-  void onBool(size_t pos, bool) override {
+  void onBool(size_t pos, bool) {
     bools++;
     boolBytes += source_->pos() - pos;
   }
 
-  void onNull(size_t pos) override {
+  void onNull(size_t pos) {
     nulls++;
     nullBytes += source_->pos() - pos;
   }
 
-  void onInt(size_t pos, int64_t) override {
+  void onInt(size_t pos, int64_t) {
     intValues.add(source_->pos() - pos);
   }
 
-  void onUint(size_t pos, uint64_t) override {
+  void onUint(size_t pos, uint64_t) {
     intValues.add(source_->pos() - pos);
   }
 
-  void onDouble(size_t pos, double) override {
+  void onDouble(size_t pos, double) {
     doubles++;
     doubleBytes += source_->pos() - pos;
   }
@@ -196,13 +196,13 @@ struct StatsValueHandler : public NoopValueHandler {
     timestampBytes += source_->pos() - pos;
   }
 
-  void onDictRef(size_t pos, size_t idx) override {
+  void onDictRef(size_t pos, size_t idx) {
     dictStringHist.add(dictionary->at(idx).size());
     dictRefs.add(source_->pos() - pos);
     dictFrequency[idx]++;
   }
 
-  void onStringStart(size_t pos, size_t len) override {
+  void onStringStart(size_t pos, size_t len) {
     stringHist.add(len);
     stringLengths.add(source_->pos() - pos);
   }
@@ -307,7 +307,8 @@ public:
       : filename_(filename) {}
 
   void decode(StatsRecordHandler &handler) const {
-    FileByteSourceImpl source(filename_, false);
+    auto sourcePtr = openFileByteSource(filename_, false, true, true);
+    auto &source = *sourcePtr;
     try {
       RecordParser(source, handler).parseStream();
     } catch (parse_error &e) {
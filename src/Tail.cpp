@@ -11,7 +11,11 @@ void usage() {
       << "usage: au tail [options] [--] <path>...\n"
       << "\n"
       << "  -h --help        show usage and exit\n"
-      << "  -f --follow      output appended data as the file grows\n"
+      << "  -f --follow      output appended data as the file grows, following\n"
+      << "                   the path if the file is rotated or truncated\n"
+      << "  -s --sleep <ms>  when following, check the file at least every <ms>\n"
+      << "                   milliseconds (default 1000). changes are normally\n"
+      << "                   noticed immediately, this is only a fallback\n"
       << "  -b --bytes <n>   start <n> bytes from end of file (default 5k)\n";
 }
 
@@ -24,6 +28,8 @@ int tail(int argc, const char *const *argv) {
   // Offset in bytes so we can fine-tune the starting point for test purposes.
   TCLAP::ValueArg<size_t> startOffset(
       "b", "bytes", "bytes", false, 5 * 1024, "integer", tclap.cmd());
+  TCLAP::ValueArg<uint32_t> sleepMs(
+      "s", "sleep", "sleep", false, 1000, "integer", tclap.cmd());
   TCLAP::UnlabeledValueArg<std::string> fileName(
       "path", "", true, "path", "", tclap.cmd());
 
@@ -35,9 +41,11 @@ int tail(int argc, const char *const *argv) {
   if (fileName.getValue().empty() || fileName.getValue() == "-") {
     std::cerr << "Tailing stdin not supported\n";
   } else {
-    FileByteSourceImpl source(fileName, follow);
+    FileByteSourceImpl source(fileName, follow, 256,
+                              std::chrono::milliseconds(sleepMs.getValue()));
     source.tail(startOffset);
-    TailHandler tailHandler(dictionary, source);
+    auto dictIndex = DictIndex::open(fileName);
+    TailHandler tailHandler(dictionary, source, dictIndex.get(), follow);
     tailHandler.parseStream(jsonHandler);
   }
 
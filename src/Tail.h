@@ -1,6 +1,7 @@
 #pragma once
 
 #include "au/AuDecoder.h"
+#include "DictIndex.h"
 #include "Dictionary.h"
 
 #include <list>
@@ -95,7 +96,7 @@ private:
  * the expected end of the value record. If we start decoding an endless string
  * of T's, we don't want to wait until the whole "record" has been unpacked
  * before coming up for air and validating the length. */
-class ValidatingHandler : public NoopValueHandler {
+class ValidatingHandler : public NoopValueHandler<ValidatingHandler> {
   const Dictionary::Dict &dictionary_;
   FileByteSource &source_;
   size_t absEndOfValue_;
@@ -107,34 +108,34 @@ public:
       : dictionary_(dictionary), source_(source), absEndOfValue_(absEndOfValue)
   {}
 
-  void onObjectStart() override { checkBounds(); }
-  void onObjectEnd() override { checkBounds(); }
-  void onArrayStart() override { checkBounds(); }
-  void onArrayEnd() override { checkBounds(); }
-  void onNull(size_t) override { checkBounds(); }
-  void onBool(size_t, bool) override { checkBounds(); }
-  void onInt(size_t, int64_t) override { checkBounds(); }
-  void onUint(size_t, uint64_t) override { checkBounds(); }
-  void onDouble(size_t, double) override { checkBounds(); }
-  void onTime(size_t, std::chrono::system_clock::time_point) override {
+  void onObjectStart() { checkBounds(); }
+  void onObjectEnd() { checkBounds(); }
+  void onArrayStart() { checkBounds(); }
+  void onArrayEnd() { checkBounds(); }
+  void onNull(size_t) { checkBounds(); }
+  void onBool(size_t, bool) { checkBounds(); }
+  void onInt(size_t, int64_t) { checkBounds(); }
+  void onUint(size_t, uint64_t) { checkBounds(); }
+  void onDouble(size_t, double) { checkBounds(); }
+  void onTime(size_t, std::chrono::system_clock::time_point) {
     checkBounds();
   }
 
-  void onDictRef(size_t, size_t dictIdx) override {
+  void onDictRef(size_t, size_t dictIdx) {
     if (dictIdx >= dictionary_.size()) {
       THROW_RT("Invalid dictionary index");
     }
     checkBounds();
   }
 
-  void onStringStart(size_t, size_t len) override {
+  void onStringStart(size_t, size_t len) {
     if (source_.pos() + len > absEndOfValue_) {
       THROW_RT("String is too long.");
     }
     checkBounds();
   }
 
-  void onStringFragment(std::string_view) override { checkBounds(); }
+  void onStringFragment(std::string_view) { checkBounds(); }
 
 private:
   void checkBounds() {
@@ -147,10 +148,16 @@ private:
 class TailHandler : public BaseParser {
   Dictionary &dictionary_;
   FileByteSource &source_;
+  const DictIndex *dictIndex_;
+  bool follow_;
 
 public:
-  TailHandler(Dictionary &dictionary, FileByteSource &source)
-      : BaseParser(source), dictionary_(dictionary), source_(source) {}
+  /// @param follow The source follows the file, so parseStream() carries on
+  /// past records broken by a rotation or truncation rather than failing.
+  TailHandler(Dictionary &dictionary, FileByteSource &source,
+              const DictIndex *dictIndex = nullptr, bool follow = false)
+      : BaseParser(source), dictionary_(dictionary), source_(source),
+        dictIndex_(dictIndex), follow_(follow) {}
 
   template <typename OutputHandler>
   void parseStream(OutputHandler &handler) {
@@ -164,7 +171,23 @@ public:
     // At this point we should have a full/valid dictionary and be positioned
     // at the start of a value record.
     AuRecordHandler<OutputHandler> recordHandler(dictionary_, handler);
-    RecordParser<decltype(recordHandler)>(source_, recordHandler).parseStream();
+    while (true) {
+      try {
+        RecordParser<decltype(recordHandler)>(source_, recordHandler)
+            .parseStream();
+        return;
+      } catch (parse_error &e) {
+        // when following, the file may have been rotated or truncated part way
+        // through a record. find the next good one and carry on from there.
+        if (!follow_) throw;
+        std::cerr << "Resynchronizing after parse error at position "
+                  << source_.pos() << ": " << e.what() << "\n";
+        if (!sync()) {
+          std::cerr << "Unable to find the start of a valid value record.\n";
+          return;
+        }
+      }
+    }
   }
 
   bool sync() {
@@ -185,6 +208,13 @@ public:
                                                  << backDictRef);
         }
 
+        // the index's checkpoint before sor has all or most of the dictionary,
+        // leaving little or none of the backref chain to follow. it's of the
+        // file we started with, not any that has replaced it since.
+        if (dictIndex_ && source_.fileStartPos() == 0
+            && !dictionary_.search(sor - backDictRef))
+          dictIndex_->load(dictionary_, sor);
+
         if (!dictionary_.search(sor - backDictRef)) {
           source_.seek(sor - backDictRef);
           DictionaryBuilder builder(source_, dictionary_, sor);
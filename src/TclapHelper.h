@@ -3,6 +3,9 @@
 #include <tclap/CmdLine.h>
 
 #include <functional>
+#include <limits>
+#include <optional>
+#include <string>
 
 class TclapHelper {
   struct UsageVisitor : public TCLAP::Visitor {
@@ -53,3 +56,21 @@ public:
     }
   }
 };
+
+/// A number of bytes, like 512, 64K or 8M
+inline std::optional<size_t> parseSize(const std::string &str) {
+  if (str.empty() || !isdigit(str[0])) return std::nullopt;
+  size_t len = 0;
+  size_t size;
+  try {
+    size = std::stoull(str, &len);
+  } catch (const std::exception &) {
+    return std::nullopt;
+  }
+  auto suffix = str.substr(len);
+  int shift = suffix == "" ? 0 : suffix == "K" ? 10 : suffix == "M" ? 20
+            : suffix == "G" ? 30 : -1;
+  if (shift < 0 || size > std::numeric_limits<size_t>::max() >> shift)
+    return std::nullopt;
+  return size << shift;
+}
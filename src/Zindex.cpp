@@ -1,25 +1,58 @@
 #include "au/AuEncoder.h"
 #include "au/ParseError.h"
 #include "DocumentParser.h"
+#include "MappedIndex.h"
 #include "Zindex.h"
 
 #include <zlib.h>
 
+#include <algorithm>
+#include <chrono>
 #include <cstring>
+#include <fcntl.h>
 #include <fstream>
 #include <libgen.h>
 #include <limits.h>
+#include <optional>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
 
 // this file contains code adapted from https://github.com/mattgodbolt/zindex
 
 namespace {
 
-constexpr auto DefaultIndexEvery = 8 * 1024 * 1024u;
 constexpr auto WindowSize = 32768u;
 constexpr auto ChunkSize = 16384u;
-constexpr auto Version = 1u;
+constexpr auto Version = 2u; // 2: access points at gzip member starts
+
+// the binary index is laid out as MappedIndex.h describes: a header, the
+// compressed file's name and the compressed windows, then the table of
+// entries.
+constexpr char BinaryMagic[8] = {'a', 'u', 'z', 'x', 'b', 'i', 'n', '\n'};
+
+struct BinaryHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t entrySize; // sizeof(BinaryEntry)
+  uint64_t compressedSize;
+  uint64_t compressedModTime;
+  uint64_t nameOffset;
+  uint64_t nameLength;
+  uint64_t tableOffset; // aligned for BinaryEntry
+  uint64_t numEntries;
+};
+
+struct BinaryEntry {
+  uint64_t uncompressedOffset;
+  uint64_t compressedOffset;
+  uint64_t windowOffset; // from the start of the index
+  uint32_t windowLength; // 0 at the start of a gzip member, and at the end
+  int32_t bitOffset;
+};
+
+static_assert(sizeof(BinaryEntry) == 32);
 
 std::string getRealPath(const std::string &relPath) {
   char realPathBuf[PATH_MAX];
@@ -56,10 +89,11 @@ size_t makeWindow(uint8_t *out, size_t outSize, const uint8_t *in,
   return destLen;
 }
 
-void uncompressWindow(const std::vector<uint8_t> &compressed, uint8_t *to,
-                      size_t len) {
+void uncompressWindow(std::string_view compressed, uint8_t *to, size_t len) {
     uLongf destLen = len;
-    X(::uncompress(to, &len, &compressed[0], compressed.size()));
+    X(::uncompress(to, &len,
+                   reinterpret_cast<const uint8_t *>(compressed.data()),
+                   compressed.size()));
     if (destLen != len)
         THROW_RT("Unable to decompress a full window");
 }
@@ -80,6 +114,11 @@ struct ZStream {
     X(inflateReset(&stream));
   }
 
+  void reset(Type newType) {
+    type = newType;
+    X(inflateReset2(&stream, (int)type));
+  }
+
   ~ZStream() {
     (void)inflateEnd(&stream);
   }
@@ -100,16 +139,239 @@ using File = std::unique_ptr<FILE, Closer>;
 struct CachedContext {
   ZStream zs_;
   size_t pos_ = 0; // current absolute position in stream
-  size_t cur_ = 0; // current offset into ZipByteSource::output_
-  size_t limit_ = 0; // number of valid bytes in ZipByteSource::output_
+  size_t cur_ = 0; // current offset into output_
+  size_t limit_ = 0; // number of valid bytes in output_
   bool eof_ = false;
+  size_t compressedPos_ = 0; // offset in the compressed file of the next read
+  std::unique_ptr<uint8_t[]> output_;
+  uint8_t input_[ChunkSize];
+
+  CachedContext(ZStream::Type type, std::unique_ptr<uint8_t[]> output,
+                size_t uncompressedOffset, size_t compressedOffset)
+      : zs_(type),
+        pos_(uncompressedOffset),
+        compressedPos_(compressedOffset),
+        output_(std::move(output)) {}
+
+  /// Start of the data still in output_
+  size_t bufStartPos() const { return pos_ - cur_; }
+};
+
+/// An access point, as found by indexMembers()
+struct AccessPoint {
+  uint64_t uncompressedOffset; // relative to the start of the run
+  uint64_t compressedOffset;
+  int bitOffset;
+  std::string window; // compressed. empty at the start of a gzip member
+};
+
+/// A run of consecutive gzip members, as indexed by indexMembers()
+struct MemberRun {
+  uint64_t start = 0; // compressed offset of the first member
+  uint64_t end = 0; // compressed offset just after the last member
+  uint64_t uncompressed = 0; // total uncompressed size of the members
+  bool atEof = false;
+  std::optional<uint64_t> garbageAt; // compressed offset of trailing garbage
+  std::vector<AccessPoint> points; // only if the caller put them here
+};
+
+/// Indexes the gzip members from compressed offset from, until the first one
+/// starting at or after until, passing each access point to onPoint.
+template <typename OnPoint>
+MemberRun indexMembers(int fd, uint64_t from, uint64_t until,
+                       const ZindexOptions &options, OnPoint &&onPoint) {
+  using Clock = std::chrono::steady_clock;
+  ZStream zs(ZStream::Type::ZlibOrGzip);
+  uint8_t input[ChunkSize];
+  uint8_t window[WindowSize];
+
+  MemberRun run;
+  run.start = from;
+  int ret = 0;
+  uint64_t readPos = from;
+  uint64_t totalIn = from;
+  uint64_t totalOut = 0;
+  uint64_t last = 0;
+  // how long inflating from the last access point took, for options.latency
+  Clock::duration sinceLastTime{};
+  // the file may be several gzip members one after another. inflate can start
+  // afresh at the start of each, so those are access points which need no
+  // window. but we only emit one once the member's header has inflated okay,
+  // in case what follows the last member is just trailing garbage.
+  std::optional<std::pair<uint64_t, uint64_t>> memberStart{{from, 0}};
+
+  while (true) {
+    if (zs.stream.avail_in == 0) {
+      auto n = ::pread(fd, input, ChunkSize, readPos);
+      if (n < 0)
+        throw ZlibError(Z_ERRNO);
+      if (n == 0) {
+        if (memberStart && memberStart->first) {
+          run.atEof = true; // the end of the last member
+          break;
+        }
+        throw ZlibError(Z_DATA_ERROR);
+      }
+      readPos += n;
+      zs.stream.avail_in = n;
+      zs.stream.next_in = input;
+    }
+    if (zs.stream.avail_out == 0) {
+      zs.stream.avail_out = WindowSize;
+      zs.stream.next_out = window;
+    }
+    totalIn += zs.stream.avail_in;
+    totalOut += zs.stream.avail_out;
+    auto inflateStart = Clock::now();
+    ret = inflate(&zs.stream, Z_BLOCK);
+    sinceLastTime += Clock::now() - inflateStart;
+    totalIn -= zs.stream.avail_in;
+    totalOut -= zs.stream.avail_out;
+    if (ret == Z_DATA_ERROR && memberStart && memberStart->first) {
+      run.garbageAt = memberStart->first;
+      break;
+    }
+    if (ret == Z_NEED_DICT)
+      throw ZlibError(Z_DATA_ERROR);
+    if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
+      throw ZlibError(ret);
+    if (memberStart) {
+      onPoint(AccessPoint{memberStart->second, memberStart->first, 0, ""});
+      last = memberStart->second;
+      sinceLastTime = {};
+      memberStart.reset();
+    }
+    if (ret == Z_STREAM_END) {
+      memberStart.emplace(totalIn, totalOut);
+      if (totalIn >= until) break;
+      X(inflateReset(&zs.stream));
+      continue;
+    }
+    auto sinceLast = totalOut - last;
+    // with a latency, checkpoints are closer together wherever the data is
+    // slower to inflate, e.g. where it's compressed further.
+    bool needsIndex = sinceLast > options.spacing
+        || (options.latency.count() && sinceLastTime >= options.latency);
+    bool endOfBlock = zs.stream.data_type & 0x80;
+    bool lastBlockInStream = zs.stream.data_type & 0x40;
+    if (endOfBlock && !lastBlockInStream && needsIndex) {
+      uint8_t apWindow[compressBound(WindowSize)];
+      auto size = makeWindow(apWindow, sizeof(apWindow), window,
+          zs.stream.avail_out);
+      onPoint(AccessPoint{
+          totalOut, totalIn, zs.stream.data_type & 0x7,
+          std::string((char *)apWindow, size) // TODO what's the right way to cast this?
+      });
+
+      last = totalOut;
+      sinceLastTime = {};
+    }
+    //progress.update<PrettyBytes>(totalIn, compressedStat.st_size); TODO?
+  }
+
+  run.end = memberStart->first;
+  run.uncompressed = totalOut;
+  return run;
+}
 
-  explicit CachedContext()
-      : zs_(ZStream::Type::ZlibOrGzip) {}
+/// The offset of the first thing in [from, until) which looks like the start
+/// of a gzip member. It may just be a coincidence in the compressed data.
+std::optional<uint64_t> findMemberHeader(int fd, uint64_t from,
+                                         uint64_t until) {
+  uint8_t buf[ChunkSize];
+  // the chunks overlap, so that a header can straddle two of them
+  for (auto pos = from; pos < until; pos += sizeof(buf) - 3) {
+    auto n = ::pread(fd, buf, sizeof(buf), pos);
+    if (n < 0) throw ZlibError(Z_ERRNO);
+    for (ssize_t i = 0; i + 3 < n && pos + i < until; i++) {
+      // magic, deflate, and no reserved flags
+      if (buf[i] == 0x1f && buf[i + 1] == 0x8b && buf[i + 2] == 8
+          && !(buf[i + 3] & 0xe0))
+        return pos + i;
+    }
+    if (n < static_cast<ssize_t>(sizeof(buf))) break;
+  }
+  return std::nullopt;
+}
 
-  explicit CachedContext(size_t uncompressedOffset)
-      : zs_(ZStream::Type::Raw),
-        pos_(uncompressedOffset) {}
+/// Writes out the entries of an index as zindexFile() finds them.
+class IndexWriter {
+public:
+  virtual ~IndexWriter() = default;
+  virtual void entry(uint64_t uncompressedOffset, uint64_t compressedOffset,
+                     int bitOffset, std::string_view window) = 0;
+  virtual void finish() = 0;
+};
+
+/// Writes the index au-encoded: slower to load, but readable with au cat.
+class AuIndexWriter : public IndexWriter {
+  std::ostream &out_;
+  AuEncoder idx_;
+
+  template <typename F>
+  void emit(F &&f) {
+    idx_.encode(f, [&](std::string_view dict, std::string_view val) {
+      out_ << dict << val; // TODO error if write fails
+      return dict.size() + val.size();
+    });
+  }
+
+public:
+  AuIndexWriter(std::ostream &out, const std::string &fileName,
+                const struct stat &compressedStat)
+      : out_(out),
+        idx_(STR("Index of " << fileName << ", written by au")) {
+    emit([&](AuWriter &au) {
+      au.map(
+        "fileType", "zindex",
+        "version", Version,
+        "compressedFile", getBaseName(fileName),
+        "compressedSize", compressedStat.st_size,
+        "compressedModTime", compressedStat.st_mtime
+      );
+    });
+  }
+
+  void entry(uint64_t uncompressedOffset, uint64_t compressedOffset,
+             int bitOffset, std::string_view window) override {
+    emit([&](AuWriter &au) {
+      au.map(
+        "uncompressedOffset", uncompressedOffset,
+        "compressedOffset", compressedOffset,
+        "bitOffset", bitOffset,
+        "window", window
+      );
+    });
+  }
+
+  void finish() override {}
+};
+
+/// Writes the binary index. The windows are written as they come, and the
+/// table and then the header once all the entries are known.
+class BinaryIndexWriter : public IndexWriter {
+  MappedIndexWriter<BinaryHeader, BinaryEntry> out_;
+
+public:
+  BinaryIndexWriter(std::ostream &out, const std::string &fileName,
+                    const struct stat &compressedStat)
+      : out_(out, BinaryMagic, Version) {
+    out_.header.compressedSize = compressedStat.st_size;
+    out_.header.compressedModTime = compressedStat.st_mtime;
+    auto name = getBaseName(fileName);
+    out_.header.nameOffset = out_.pos();
+    out_.header.nameLength = name.size();
+    out_.write(name.data(), name.size());
+  }
+
+  void entry(uint64_t uncompressedOffset, uint64_t compressedOffset,
+             int bitOffset, std::string_view window) override {
+    out_.add(BinaryEntry{uncompressedOffset, compressedOffset, out_.pos(),
+                         static_cast<uint32_t>(window.size()), bitOffset});
+    out_.write(window.data(), window.size());
+  }
+
+  void finish() override { out_.finish(); }
 };
 
 std::string getIndexFilename(const std::string &filename,
@@ -121,8 +383,9 @@ std::string getIndexFilename(const std::string &filename,
 }
 
 int zindexFile(const std::string &fileName,
-               const std::optional<std::string> &indexFilename) {
-  size_t indexEvery = DefaultIndexEvery; // TODO extract
+               const std::optional<std::string> &indexFilename,
+               const ZindexOptions &options) {
+  auto jobs = options.jobs;
 
   auto ifn = getIndexFilename(fileName, indexFilename);
   std::cout << "Indexing " << fileName << " to " << ifn << "...\n";
@@ -148,125 +411,125 @@ int zindexFile(const std::string &fileName,
     return 1;
   }
 
-  AuEncoder idx(STR("Index of " << fileName << ", written by au"));
-  auto emit = [&](auto &&f) {
-    idx.encode(f, [&](std::string_view dict, std::string_view val) {
-      out << dict << val; // TODO error if write fails
-      return dict.size() + val.size();
-    });
-  };
-
-  emit([&](AuWriter &au) {
-    au.map(
-      "fileType", "zindex",
-      "version", Version,
-      "compressedFile", getBaseName(fileName),
-      "compressedSize", compressedStat.st_size,
-      "compressedModTime", compressedStat.st_mtime
-    );
-  });
+  std::unique_ptr<IndexWriter> writer;
+  if (options.auEncoded)
+    writer = std::make_unique<AuIndexWriter>(out, fileName, compressedStat);
+  else
+    writer = std::make_unique<BinaryIndexWriter>(out, fileName, compressedStat);
 
   // actually build the index...
-  ZStream zs(ZStream::Type::ZlibOrGzip);
-  uint8_t input[ChunkSize];
-  uint8_t window[WindowSize];
-
-  int ret = 0;
-  uint64_t totalIn = 0;
-  uint64_t totalOut = 0;
-  uint64_t last = 0;
-  bool emitInitialAccessPoint = true;
-
-  do {
-    if (zs.stream.avail_in == 0) {
-      zs.stream.avail_in = fread(input, 1, ChunkSize, from.get());
-      if (ferror(from.get()))
-        throw ZlibError(Z_ERRNO);
-      if (zs.stream.avail_in == 0)
-        throw ZlibError(Z_DATA_ERROR);
-      zs.stream.next_in = input;
-    }
-    do {
-      if (zs.stream.avail_out == 0) {
-        zs.stream.avail_out = WindowSize;
-        zs.stream.next_out = window;
-      }
-      totalIn += zs.stream.avail_in;
-      totalOut += zs.stream.avail_out;
-      ret = inflate(&zs.stream, Z_BLOCK);
-      totalIn -= zs.stream.avail_in;
-      totalOut -= zs.stream.avail_out;
-      if (ret == Z_NEED_DICT)
-        throw ZlibError(Z_DATA_ERROR);
-      if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
-        throw ZlibError(ret);
-      if (ret == Z_STREAM_END)
-        break;
-      auto sinceLast = totalOut - last;
-      bool needsIndex = sinceLast > indexEvery
-                        || emitInitialAccessPoint;
-      bool endOfBlock = zs.stream.data_type & 0x80;
-      bool lastBlockInStream = zs.stream.data_type & 0x40;
-      if (endOfBlock && !lastBlockInStream && needsIndex) {
-        std::cout << "Creating checkpoint at " << totalOut <<
-          " (compressed offset " << totalIn << ")\n";
-        uint8_t apWindow[compressBound(WindowSize)];
-        auto size = makeWindow(apWindow, sizeof(apWindow), window,
-            zs.stream.avail_out);
-        auto window =
-            std::string_view((char *)apWindow, size); // TODO what's the right way to cast this?
-        emit([&](AuWriter &au) {
-          au.map(
-            "uncompressedOffset", totalOut,
-            "compressedOffset", totalIn,
-            "bitOffset", zs.stream.data_type & 0x7,
-            "window", window
-          );
-        });
+  auto emitPoint = [&](const AccessPoint &point, uint64_t base) {
+    auto uncompressedOffset = base + point.uncompressedOffset;
+    std::cout << "Creating checkpoint at " << uncompressedOffset <<
+      " (compressed offset " << point.compressedOffset <<
+      (point.window.empty() ? ", start of gzip member)\n" : ")\n");
+    writer->entry(uncompressedOffset, point.compressedOffset,
+                  point.bitOffset, point.window);
+  };
 
-        last = totalOut;
-        emitInitialAccessPoint = false;
+  // with several jobs, each takes its own stretch of the compressed file and
+  // indexes the members starting there. they have to guess where the first
+  // of those starts, so their runs only count if the previous run ended just
+  // where they guessed. whatever isn't covered is indexed here, serially.
+  auto fd = fileno(from.get());
+  uint64_t compressedSize = compressedStat.st_size;
+  std::vector<uint64_t> stretches;
+  std::vector<std::optional<MemberRun>> runs(jobs > 1 ? jobs : 0);
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < runs.size(); i++)
+    stretches.push_back(compressedSize * i / jobs);
+  for (size_t i = 0; i < runs.size(); i++) {
+    workers.emplace_back([&, i] {
+      auto until = i + 1 < jobs ? stretches[i + 1] : compressedSize;
+      auto pos = stretches[i];
+      while (auto candidate = findMemberHeader(fd, pos, until)) {
+        std::vector<AccessPoint> points;
+        try {
+          auto run = indexMembers(fd, *candidate, until, options,
+                                  [&](AccessPoint &&point) {
+                                    points.emplace_back(std::move(point));
+                                  });
+          if (run.garbageAt != *candidate) {
+            run.points = std::move(points);
+            runs[i] = std::move(run);
+            break;
+          }
+        } catch (const std::exception &) {
+          // not a member start after all, then
+        }
+        pos = *candidate + 1;
       }
-      //progress.update<PrettyBytes>(totalIn, compressedStat.st_size); TODO?
-    } while (zs.stream.avail_in);
-  } while (ret != Z_STREAM_END);
+    });
+  }
+  for (auto &worker : workers) worker.join();
 
-  if (zs.stream.avail_in || !feof(from.get())) {
-    std::cout << "\n"
-              << "WARNING: this file appears to contain multiple gzip blocks.\n"
-              << "This tool does not currently support such files!\n"
-              << "Data beyond the first block will not be indexed.\n\n";
+  uint64_t compressedPos = 0;
+  uint64_t uncompressedPos = 0;
+  while (true) {
+    auto it = std::find_if(runs.begin(), runs.end(), [&](auto &run) {
+      return run && run->start == compressedPos;
+    });
+    MemberRun run;
+    if (it != runs.end()) {
+      run = std::move(**it);
+      for (auto &point : run.points) emitPoint(point, uncompressedPos);
+    } else {
+      auto until = std::upper_bound(stretches.begin(), stretches.end(),
+                                    compressedPos);
+      run = indexMembers(fd, compressedPos,
+                         until == stretches.end() ? compressedSize : *until,
+                         options, [&](AccessPoint &&point) {
+                           emitPoint(point, uncompressedPos);
+                         });
+    }
+    compressedPos = run.end;
+    uncompressedPos += run.uncompressed;
+    if (run.garbageAt) {
+      std::cout << "\n"
+                << "WARNING: ignoring trailing garbage after the last gzip "
+                   "member, at compressed offset " << *run.garbageAt
+                << ".\n\n";
+      break;
+    }
+    if (run.atEof) break;
   }
 
   // TODO find a better way to record the total uncompressed size...
   std::cout << "Writing final entry...\n";
-  emit([&](AuWriter &au) {
-    au.map(
-        "uncompressedOffset", totalOut,
-        "compressedOffset", totalIn,
-        "bitOffset", zs.stream.data_type & 0x7,
-        "window", ""
-    );
-  });
+  writer->entry(uncompressedPos, compressedPos, 0, "");
+  writer->finish();
 
   std::cout << "Index complete.\n";
   return 0;
 }
 
-struct Zindex {
-  struct IndexEntry {
-    size_t compressedOffset = 0;
-    size_t uncompressedOffset = 0;
-    int bitOffset = 0;
-    std::vector<uint8_t> window;
-  };
-
-  std::vector<IndexEntry> index_;
-  std::string compressedFilename;
-  size_t compressedSize = 0;
-  size_t compressedModTime = 0;
+class Zindex {
+  MappedFile map_;
+  const BinaryEntry *entries_ = nullptr;
+  size_t numEntries_ = 0;
+  const char *windows_ = nullptr; // what the entries' windowOffsets are from
+  // what an au-encoded index loads into, in place of the mapping
+  std::vector<BinaryEntry> auEntries_;
+  std::string auWindows_;
+
+  void loadBinary(const std::string &filename) {
+    auto header = readIndexHeader<BinaryHeader, BinaryEntry>(
+        map_, BinaryMagic, 2, Version, filename);
+    if (!inIndexData(header, header.nameOffset, header.nameLength))
+      THROW_RT("Corrupt index: name out of bounds");
+    compressedFilename.assign(map_.data() + header.nameOffset,
+                              header.nameLength);
+    compressedSize = header.compressedSize;
+    compressedModTime = header.compressedModTime;
+    entries_ = indexTable<BinaryEntry>(map_, header);
+    numEntries_ = header.numEntries;
+    windows_ = map_.data();
+    for (auto &entry : *this)
+      if (!inIndexData(header, entry.windowOffset, entry.windowLength))
+        THROW_RT("Corrupt index: window out of bounds");
+  }
 
-  Zindex(const std::string &filename) {
+  void loadAu(const std::string &filename) {
     FileByteSourceImpl source(filename, false);
     Dictionary dictionary;
 
@@ -279,8 +542,10 @@ struct Zindex {
                                      meta["fileType"].GetStringLength());
     if (fileType != "zindex")
       THROW_RT("Wrong fileType in index, expected 'zindex'");
-    if (!meta["version"].IsInt() || meta["version"].GetInt() != 1)
-      THROW_RT("Wrong version index, expected version 1");
+    // version 1 indices just lack the access points at gzip member starts
+    if (!meta["version"].IsInt() || meta["version"].GetInt() < 1
+        || meta["version"].GetInt() > static_cast<int>(Version))
+      THROW_RT("Wrong version index, expected version 1 to " << Version);
     compressedFilename =
         std::string_view(meta["compressedFile"].GetString(),
                          meta["compressedFile"].GetStringLength());
@@ -296,32 +561,76 @@ struct Zindex {
       auto bitOffset = entry["bitOffset"].GetInt();
       auto window = std::string_view(entry["window"].GetString(),
           entry["window"].GetStringLength());
-      index_.emplace_back(IndexEntry {
-        compressedOffset,
+      auEntries_.emplace_back(BinaryEntry {
         uncompressedStartOffset,
-        bitOffset,
-        std::vector<uint8_t>(window.begin(), window.end())
+        compressedOffset,
+        auWindows_.size(),
+        static_cast<uint32_t>(window.size()),
+        bitOffset
       });
+      auWindows_.append(window);
+    }
+    entries_ = auEntries_.data();
+    numEntries_ = auEntries_.size();
+    windows_ = auWindows_.data();
+  }
+
+public:
+  using IndexEntry = BinaryEntry;
+
+  std::string compressedFilename;
+  size_t compressedSize = 0;
+  size_t compressedModTime = 0;
+
+  Zindex(const std::string &filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd == -1)
+      THROW_RT("open: " << strerror(errno) << " (" << filename << ")");
+    try {
+      map_ = MappedFile(fd, filename);
+    } catch (...) {
+      close(fd);
+      throw;
+    }
+    close(fd); // the mapping keeps its own reference to the file
+
+    if (map_.startsWith(BinaryMagic)) {
+      loadBinary(filename);
+    } else {
+      // the older, au-encoded index. only the binary one is used in place
+      map_ = MappedFile();
+      loadAu(filename);
     }
 
-    if (index_.empty())
+    if (!numEntries_)
       THROW_RT("Index should contain at least one entry!");
   }
 
-  size_t numEntries() const { return index_.size(); }
+  Zindex(const Zindex &) = delete;
+  Zindex &operator=(const Zindex &) = delete;
+
+  const IndexEntry *begin() const { return entries_; }
+  const IndexEntry *end() const { return entries_ + numEntries_; }
+
+  size_t numEntries() const { return numEntries_; }
+
+  /// The entry's compressed window, empty if it's the start of a gzip member
+  std::string_view window(const IndexEntry &entry) const {
+    return std::string_view(windows_ + entry.windowOffset, entry.windowLength);
+  }
 
   size_t uncompressedSize() const {
     // total stream size is "start" of dummy final entry
-    return index_.back().uncompressedOffset;
+    return end()[-1].uncompressedOffset;
   }
 
-  IndexEntry &find(size_t abspos) {
+  const IndexEntry &find(size_t abspos) const {
     auto it = std::upper_bound(
-        index_.begin(), index_.end(), abspos,
+        begin(), end(), abspos,
         [](size_t abspos, const IndexEntry &entry) {
           return abspos < entry.uncompressedOffset;
         });
-    if (it == index_.begin())
+    if (it == begin())
       THROW_RT("Couldn't find index entry containing " << abspos);
     --it;
     return *it;
@@ -329,23 +638,28 @@ struct Zindex {
 };
 
 struct ZipByteSource::Impl {
+  // bisect keeps revisiting the same few checkpoints, so we keep the most
+  // recently used inflate contexts (with their output) and decompressed
+  // windows around rather than starting from scratch on every far seek.
+  static constexpr size_t MaxContexts = 4;
+  static constexpr size_t MaxWindows = 16;
+  static constexpr size_t JumpCost = 4 * WindowSize;
+
   File compressed_;
   Zindex index_;
-  // based on the average block size, used to determine whether to seek forward
-  // by decompressing or seeking to a new block. also used to determine the size
-  // of the decompression lookback buffer to use after each seek
+  // based on the average block size, used to determine the size of the
+  // decompression lookback buffer to use after each seek
   size_t blockSize_;
-  std::unique_ptr<CachedContext> context_;
-  uint8_t input_[ChunkSize];
-  uint8_t *output_;
+  /// Most recently used first. The front one is the current context.
+  std::vector<std::unique_ptr<CachedContext>> contexts_;
+  /// Decompressed windows by index entry, most recently used first
+  std::vector<std::pair<size_t, std::unique_ptr<uint8_t[]>>> windows_;
 
   Impl(const std::string &fname,
        const std::optional<std::string> &indexFname)
       : compressed_(fopen(fname.c_str(), "rb")),
         index_(getIndexFilename(fname, indexFname)),
-        blockSize_(2 * index_.uncompressedSize() / index_.numEntries()),
-        context_(new CachedContext()),
-        output_(new uint8_t[blockSize_]) {
+        blockSize_(2 * index_.uncompressedSize() / index_.numEntries()) {
     if (compressed_.get() == nullptr)
       THROW_RT("Could not open " << fname << " for reading");
 
@@ -362,18 +676,18 @@ struct ZipByteSource::Impl {
     if (index_.compressedModTime != (uint64_t)stats.st_mtime) // TODO what cast here?
       THROW_RT("Compressed file has been modified since index was built");
 
-    context_->zs_.stream.avail_in = 0;
+    contexts_.emplace_back(
+        new CachedContext(ZStream::Type::ZlibOrGzip,
+                          std::make_unique<uint8_t[]>(blockSize_), 0, 0));
   }
 
-  ~Impl() {
-    delete[] output_;
-  }
+  CachedContext &context() { return *contexts_.front(); }
 
   size_t doRead(char *buf, size_t len) {
-    auto &c = *context_;
+    auto &c = context();
     if (c.cur_ == c.limit_) gzread();
     auto n = std::min(c.limit_ - c.cur_, len);
-    ::memcpy(buf, output_+c.cur_, n);
+    ::memcpy(buf, c.output_.get() + c.cur_, n);
     c.cur_ += n;
     c.pos_ += n;
     return n;
@@ -384,59 +698,61 @@ struct ZipByteSource::Impl {
   }
 
   void doSeek(size_t abspos) {
-    auto &c = *context_;
+    auto &entry = index_.find(abspos);
+
+    // use whichever cached context gets there most cheaply: one which still
+    // has abspos in its output, or else one which can get there by inflating
+    // not much further than it would take from the checkpoint. starting
+    // afresh at the checkpoint costs about as much as inflating JumpCost.
+    auto best = contexts_.end();
+    for (auto it = contexts_.begin(); it != contexts_.end(); ++it) {
+      auto &c = **it;
+      auto bufEndPos = c.pos_ + (c.limit_ - c.cur_);
+      if (abspos >= c.bufStartPos() && abspos <= bufEndPos) {
+        best = it;
+        break;
+      }
+      bool cheaper = c.pos_ + JumpCost >= entry.uncompressedOffset;
+      if (abspos >= c.pos_ && cheaper
+          && (best == contexts_.end() || c.pos_ > (*best)->pos_))
+        best = it;
+    }
 
-    if (abspos < c.pos_ && c.pos_ - abspos <= c.cur_) {
-      // we're seeking backward within current buffer
-      auto relseek = c.pos_ - abspos;
-      c.cur_ -= relseek;
-      c.pos_ -= relseek;
+    if (best != contexts_.end()) {
+      std::rotate(contexts_.begin(), best, best + 1);
+    } else {
+      // reuse the evicted context's output buffer: a fresh one would have to
+      // be faulted in all over again.
+      std::unique_ptr<uint8_t[]> output;
+      if (contexts_.size() == MaxContexts) {
+        output = std::move(contexts_.back()->output_);
+        contexts_.pop_back();
+      } else {
+        output.reset(new uint8_t[blockSize_]);
+      }
+      contexts_.emplace(contexts_.begin(),
+                        newContext(entry, std::move(output)));
+    }
+
+    auto &c = context();
+    if (abspos < c.pos_) {
+      // seeking backward within its output
+      c.cur_ -= c.pos_ - abspos;
+      c.pos_ = abspos;
       return;
     }
 
     size_t bufRemaining = c.limit_ - c.cur_;
-    if (abspos > c.pos_ && abspos - c.pos_ <= bufRemaining) {
-      // we're seeking forward within current buffer
+    if (abspos - c.pos_ <= bufRemaining) {
+      // seeking forward within its output
       auto relseek = abspos - c.pos_;
       c.cur_ += relseek;
       c.pos_ += relseek;
       return;
     }
 
-    // now we're either seeking backward, or else forward beyond end of
-    // buffer. do we really need to seek? or can we just skip ahead some?
-    if (abspos < c.pos_ || abspos > blockSize_ + bufRemaining) {
-      // we're either seeking backward beyond the start of output_,
-      // or far enough forward that it's better to jump instead of scan.
-      Zindex::IndexEntry &indexEntry = index_.find(abspos);
-      auto compressedOffset = indexEntry.compressedOffset;
-      auto uncompressedOffset = indexEntry.uncompressedOffset;
-      auto bitOffset = indexEntry.bitOffset;
-      //log_.debug("Creating new context at offset ", compressedOffset); TODO
-      context_.reset(new CachedContext(uncompressedOffset));
-      uint8_t window[WindowSize];
-      uncompressWindow(indexEntry.window, window, WindowSize);
-
-      auto seekPos = bitOffset ? compressedOffset - 1 : compressedOffset;
-      auto err = ::fseek(compressed_.get(), seekPos, SEEK_SET);
-      if (err != 0)
-        THROW_RT("Error seeking in file"); // todo errno
-      context_->zs_.stream.avail_in = 0;
-      if (bitOffset) {
-        auto c = fgetc(compressed_.get());
-        if (c == -1)
-          throw ZlibError(ferror(compressed_.get()) ?
-              Z_ERRNO : Z_DATA_ERROR);
-        X(inflatePrime(&context_->zs_.stream, bitOffset, c >> (8 - bitOffset)));
-      }
-      X(inflateSetDictionary(&context_->zs_.stream, &window[0], WindowSize));
-    }
-
-    if (abspos < context_->pos_)
-      THROW_RT("Invariant abspos >= context_->pos_ doesn't hold: abspos = "
-                   << abspos << ", context_->pos_ = " << context_->pos_);
     char discardBuffer[WindowSize];
-    auto numToSkip = abspos - context_->pos_;
+    auto numToSkip = abspos - c.pos_;
     while (numToSkip) {
       auto skipNow = std::min(WindowSize, (uInt)numToSkip);
       auto numRead = doRead(discardBuffer, skipNow);
@@ -445,29 +761,97 @@ struct ZipByteSource::Impl {
     }
   }
 
+  /// A new context positioned at the checkpoint
+  std::unique_ptr<CachedContext> newContext(const Zindex::IndexEntry &entry,
+                                            std::unique_ptr<uint8_t[]> output) {
+    auto compressedOffset = entry.compressedOffset;
+    auto bitOffset = entry.bitOffset;
+    //log_.debug("Creating new context at offset ", compressedOffset); TODO
+    if (!entry.windowLength) {
+      // the start of a gzip member (or the end of the file)
+      return std::make_unique<CachedContext>(
+          ZStream::Type::ZlibOrGzip, std::move(output),
+          entry.uncompressedOffset, compressedOffset);
+    }
+    std::unique_ptr<CachedContext> context(
+        new CachedContext(ZStream::Type::Raw, std::move(output),
+                          entry.uncompressedOffset,
+                          bitOffset ? compressedOffset - 1 : compressedOffset));
+    auto &zs = context->zs_;
+    if (bitOffset) {
+      uint8_t c;
+      auto n = ::pread(fileno(compressed_.get()), &c, 1,
+                       context->compressedPos_++);
+      if (n != 1) throw ZlibError(n < 0 ? Z_ERRNO : Z_DATA_ERROR);
+      X(inflatePrime(&zs.stream, bitOffset, c >> (8 - bitOffset)));
+    }
+    X(inflateSetDictionary(&zs.stream, window(entry), WindowSize));
+    return context;
+  }
+
+  /// The decompressed window for the checkpoint
+  const uint8_t *window(const Zindex::IndexEntry &entry) {
+    size_t key = &entry - index_.begin();
+    auto it = std::find_if(windows_.begin(), windows_.end(),
+                           [key](auto &w) { return w.first == key; });
+    if (it == windows_.end()) {
+      if (windows_.size() == MaxWindows) windows_.pop_back();
+      std::unique_ptr<uint8_t[]> window(new uint8_t[WindowSize]);
+      uncompressWindow(index_.window(entry), window.get(), WindowSize);
+      windows_.emplace_back(key, std::move(window));
+      it = windows_.end() - 1;
+    }
+    std::rotate(windows_.begin(), it, it + 1);
+    return windows_.front().second.get();
+  }
+
+  /// The gzip member starting at uncompressed position pos, somewhere at or
+  /// after compressed position from
+  const Zindex::IndexEntry *nextMember(size_t pos, size_t from) const {
+    // not the final entry: that's just the end of the file
+    auto last = index_.end() - 1;
+    auto it = std::lower_bound(
+        index_.begin(), last, pos,
+        [](const Zindex::IndexEntry &entry, size_t pos) {
+          return entry.uncompressedOffset < pos;
+        });
+    for (; it != last && it->uncompressedOffset == pos; ++it)
+      if (!it->windowLength && it->compressedOffset >= from) return it;
+    return nullptr;
+  }
+
   size_t gzread() {
-    if (context_->eof_) return 0;
+    auto &c = context();
+    if (c.eof_) return 0;
 
-    if (context_->cur_ != context_->limit_)
+    if (c.cur_ != c.limit_)
       THROW_RT("Shouldn't call gzread() unless cur_ == limit_!");
 
-    if (context_->cur_ == blockSize_) {
+    if (c.cur_ == blockSize_) {
       // buffer is full. we're only called when we're supposed to read
       // something, so just clear it and continue...
-      context_->cur_ = context_->limit_ = 0;
+      c.cur_ = c.limit_ = 0;
     }
 
-    auto &zs = context_->zs_;
-    zs.stream.next_out = output_+context_->limit_;
+    auto &zs = c.zs_;
+    zs.stream.next_out = c.output_.get() + c.limit_;
     zs.stream.avail_out =
-        std::min((unsigned int)(blockSize_ - context_->limit_), ChunkSize); // TODO ChunkSize or whatever...
+        std::min((unsigned int)(blockSize_ - c.limit_), ChunkSize); // TODO ChunkSize or whatever...
     size_t total = 0;
     do {
       if (zs.stream.avail_in == 0) {
-        zs.stream.avail_in = ::fread(input_, 1, sizeof(input_),
-                                     compressed_.get());
-        if (ferror(compressed_.get())) throw ZlibError(Z_ERRNO);
-        zs.stream.next_in = input_;
+        // pread, since other cached contexts read the same file elsewhere
+        auto n = ::pread(fileno(compressed_.get()), c.input_,
+                         sizeof(c.input_), c.compressedPos_);
+        if (n < 0) throw ZlibError(Z_ERRNO);
+        if (n == 0) {
+          // truncated: there'll never be any more.
+          c.eof_ = true;
+          break;
+        }
+        c.compressedPos_ += n;
+        zs.stream.avail_in = n;
+        zs.stream.next_in = c.input_;
       }
       auto availBefore = zs.stream.avail_out;
       auto ret = inflate(&zs.stream, Z_NO_FLUSH);
@@ -475,17 +859,21 @@ struct ZipByteSource::Impl {
       if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
         throw ZlibError(ret);
       auto numUncompressed = availBefore - zs.stream.avail_out;
-      context_->limit_ += numUncompressed;
+      c.limit_ += numUncompressed;
       total += numUncompressed;
       if (ret == Z_STREAM_END) {
-        // this is the end of the first gzip block. we don't currently
-        // support multiple blocks... it's hard for us to detect here whether
-        // there are multiple blocks or not, because in the presence of the
-        // gzip framing data, the underlying file might not actually be at
-        // eof. so we don't bother to detect or warn. they will have gotten
-        // the warning when the built the index, at least.
-        context_->eof_ = true;
-        break;
+        // the end of a gzip member (or, for a raw context, of its deflate
+        // stream, with the member's trailer still to come). carry on from
+        // the start of the next member, if the index knows of one.
+        auto next = nextMember(c.pos_ + (c.limit_ - c.cur_),
+                               c.compressedPos_ - zs.stream.avail_in);
+        if (!next) {
+          c.eof_ = true;
+          break;
+        }
+        c.compressedPos_ = next->compressedOffset;
+        zs.stream.avail_in = 0;
+        zs.reset(ZStream::Type::ZlibOrGzip);
       }
     } while (zs.stream.avail_out);
     return total;
@@ -507,6 +895,140 @@ size_t ZipByteSource::endPos() const {
   return impl_->endPos();
 }
 
+std::vector<size_t> ZipByteSource::accessPoints() const {
+  std::vector<size_t> result;
+  for (auto &entry : impl_->index_)
+    result.push_back(entry.uncompressedOffset);
+  return result;
+}
+
 void ZipByteSource::doSeek(size_t abspos) {
   return impl_->doSeek(abspos);
 }
+
+struct ZipWriter::Impl {
+  std::string fileName_;
+  std::optional<std::string> indexFilename_;
+  ZindexOptions options_;
+  File out_;
+  z_stream zs_;
+  uint64_t totalIn_ = 0;
+  uint64_t totalOut_ = 0;
+  uint64_t memberIn_ = 0; // uncompressed bytes in the current member
+  bool memberOpen_ = false;
+  bool failed_ = false; // a write failed, so the file is incomplete
+  /// (uncompressed, compressed) offsets of the start of each gzip member
+  std::vector<std::pair<uint64_t, uint64_t>> memberStarts_;
+  uint8_t output_[ChunkSize];
+
+  Impl(const std::string &fileName,
+       const std::optional<std::string> &indexFilename,
+       const ZindexOptions &options)
+      : fileName_(fileName), indexFilename_(indexFilename), options_(options),
+        out_(fopen(fileName.c_str(), "wb")) {
+    if (options_.spacing == 0)
+      THROW_RT("Checkpoint spacing must be more than zero");
+    if (out_.get() == nullptr)
+      THROW_RT("Could not open " << fileName << " for writing");
+    memset(&zs_, 0, sizeof(zs_));
+    // 31: gzip framing, with the largest window
+    X(deflateInit2(&zs_, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 31, 8,
+                   Z_DEFAULT_STRATEGY));
+  }
+
+  ~Impl() {
+    (void)deflateEnd(&zs_);
+  }
+
+  void deflateAll(int flush) {
+    int ret;
+    do {
+      zs_.next_out = output_;
+      zs_.avail_out = sizeof(output_);
+      ret = deflate(&zs_, flush);
+      if (ret == Z_STREAM_ERROR) throw ZlibError(ret);
+      auto n = sizeof(output_) - zs_.avail_out;
+      if (fwrite(output_, 1, n, out_.get()) != n)
+        THROW_RT("Unable to write to " << fileName_);
+      totalOut_ += n;
+    } while (zs_.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+  }
+
+  void write(const char *data, size_t len) {
+    try {
+      doWrite(data, len);
+    } catch (...) {
+      failed_ = true;
+      throw;
+    }
+  }
+
+  void doWrite(const char *data, size_t len) {
+    while (len) {
+      if (!memberOpen_) {
+        memberStarts_.emplace_back(totalIn_, totalOut_);
+        memberOpen_ = true;
+      }
+      auto n = std::min(len, options_.spacing - memberIn_);
+      zs_.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+      zs_.avail_in = n;
+      deflateAll(Z_NO_FLUSH);
+      data += n;
+      len -= n;
+      totalIn_ += n;
+      memberIn_ += n;
+      if (memberIn_ == options_.spacing) finishMember();
+    }
+  }
+
+  void finishMember() {
+    deflateAll(Z_FINISH);
+    X(deflateReset(&zs_));
+    memberIn_ = 0;
+    memberOpen_ = false;
+  }
+
+  void close() {
+    if (failed_)
+      THROW_RT("Not indexing " << fileName_ << ": an earlier write failed");
+    // an empty member, rather than an empty file, if nothing was written
+    if (memberOpen_ || memberStarts_.empty()) {
+      if (!memberOpen_) memberStarts_.emplace_back(totalIn_, totalOut_);
+      finishMember();
+    }
+    if (fclose(out_.release()) != 0)
+      THROW_RT("Unable to write to " << fileName_);
+
+    struct stat compressedStat;
+    if (stat(fileName_.c_str(), &compressedStat) != 0)
+      THROW_RT("Unable to get file stats of " << fileName_);
+    auto ifn = getIndexFilename(fileName_, indexFilename_);
+    std::ofstream out(ifn, std::ios_base::binary | std::ios_base::trunc);
+    if (!out) THROW_RT("Unable to open output " << ifn);
+    std::unique_ptr<IndexWriter> writer;
+    if (options_.auEncoded)
+      writer = std::make_unique<AuIndexWriter>(out, fileName_, compressedStat);
+    else
+      writer = std::make_unique<BinaryIndexWriter>(out, fileName_,
+                                                   compressedStat);
+    for (auto &[uncompressed, compressed] : memberStarts_)
+      writer->entry(uncompressed, compressed, 0, "");
+    writer->entry(totalIn_, totalOut_, 0, "");
+    writer->finish();
+  }
+};
+
+ZipWriter::ZipWriter(const std::string &fileName,
+                     const std::optional<std::string> &indexFilename,
+                     const ZindexOptions &options)
+    : impl_(std::make_unique<Impl>(fileName, indexFilename, options)) {}
+
+ZipWriter::~ZipWriter() {}
+
+void ZipWriter::write(std::string_view data) {
+  impl_->write(data.data(), data.size());
+}
+
+void ZipWriter::close() {
+  impl_->close();
+}
@@ -2,11 +2,32 @@
 
 #include "au/AuDecoder.h"
 
+#include <chrono>
 #include <memory>
 #include <optional>
+#include <string_view>
+#include <vector>
+
+/// How zindexFile() builds an index.
+struct ZindexOptions {
+  static constexpr size_t DefaultSpacing = 8 * 1024 * 1024;
+
+  /// Most uncompressed bytes between checkpoints. A seek inflates up to this
+  /// much from the checkpoint before it.
+  size_t spacing = DefaultSpacing;
+  /// If set, also checkpoint once inflating from the last checkpoint has
+  /// taken this long, as measured while indexing.
+  std::chrono::milliseconds latency{0};
+  /// Threads to index gzip members on.
+  unsigned jobs = 1;
+  /// Write the older au-encoded index, which is readable with au cat but much
+  /// slower to load than the binary one.
+  bool auEncoded = false;
+};
 
 int zindexFile(const std::string &fileName,
-               const std::optional<std::string> &indexFilename);
+               const std::optional<std::string> &indexFilename,
+               const ZindexOptions &options);
 
 class ZipByteSource : public FileByteSource {
   class Impl;
@@ -16,7 +37,33 @@ public:
                          const std::optional<std::string> &indexFname);
   ~ZipByteSource();
 
+  /// Uncompressed positions of the index's access points, where decompression
+  /// can start without decompressing anything before them.
+  std::vector<size_t> accessPoints() const;
+
   size_t doRead(char *buf, size_t len) override;
   size_t endPos() const override;
   void doSeek(size_t abspos) override;
 };
+
+/// Gzips whatever is written to it into a file, indexing the file for
+/// ZipByteSource as it goes, so there's no need to run zindexFile() on it
+/// afterwards. The file is made of gzip members of options.spacing
+/// uncompressed bytes each, every one of them an access point which needs no
+/// window.
+class ZipWriter {
+  class Impl;
+  std::unique_ptr<Impl> impl_;
+public:
+  ZipWriter(const std::string &fileName,
+            const std::optional<std::string> &indexFilename,
+            const ZindexOptions &options);
+  ~ZipWriter();
+
+  /// Compresses data. Throws if it can't be written.
+  void write(std::string_view data);
+
+  /// Finishes the gzip file, then writes its index. Until then, the index
+  /// isn't written at all, nor is it if any earlier write failed.
+  void close();
+};
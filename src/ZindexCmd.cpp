@@ -1,5 +1,8 @@
 #include "TclapHelper.h"
 #include "Zindex.h"
+#include "ZstdByteSource.h"
+
+#include <limits>
 
 namespace {
 
@@ -8,10 +11,21 @@ void usage() {
       << "usage: au zindex [options] [--] <path>\n"
       << "\n"
       << " Builds an index for a gzipped au file. Writes index to <path>.auzx.\n"
+      << " Seekable zstd files have their own seek table, and need no index.\n"
       << " <path> may be \"-\" for stdin, in which case index is written to stdin.auzx.\n"
       << "\n"
       << "  -h --help          show usage and exit\n"
-      << "  -x --index <path>  write index to <path> (defaults to inputpath.au.auzx)\n";
+      << "  -x --index <path>  write index to <path> (defaults to inputpath.au.auzx)\n"
+      << "  -s --spacing <n>   checkpoint every <n> uncompressed bytes (default 8M).\n"
+      << "                     <n> may end in K, M or G. the closer they are, the\n"
+      << "                     faster zgrep seeks, and the bigger the index\n"
+      << "  -l --latency <ms>  also checkpoint wherever inflating from the last\n"
+      << "                     one took <ms>, as timed while indexing. the default\n"
+      << "                     spacing doesn't apply unless -s is also given\n"
+      << "  -j --jobs <n>      index with <n> threads. only helps if the file is\n"
+      << "                     made of many gzip members, like bgzip's output\n"
+      << "  -a --au            write the index au-encoded, so it can be read with\n"
+      << "                     au cat. it's slower to load than the default\n";
 
 }
 
@@ -24,12 +38,41 @@ int zindex(int argc, const char * const *argv) {
       "path", "", true, "", "path", tclap.cmd());
   TCLAP::ValueArg<std::string> index(
       "x", "index", "index", false, "", "string", tclap.cmd());
+  TCLAP::ValueArg<std::string> spacing(
+      "s", "spacing", "spacing", false, "", "string", tclap.cmd());
+  TCLAP::ValueArg<uint32_t> latency(
+      "l", "latency", "latency", false, 0, "uint32_t", tclap.cmd());
+  TCLAP::ValueArg<uint32_t> jobs(
+      "j", "jobs", "jobs", false, 1, "uint32_t", tclap.cmd());
+  TCLAP::SwitchArg auEncoded("a", "au", "au", tclap.cmd());
 
   if (!tclap.parse(argc, argv)) return 1;
 
   std::optional<std::string> indexFile;
   if (index.isSet()) indexFile = index.getValue();
 
+  if (ZstdByteSource::isSeekableZstd(path.getValue())) {
+    std::cout << path.getValue() << " is seekable zstd, which has its own seek "
+                                    "table: it needs no index.\n";
+    return 0;
+  }
+
+  ZindexOptions options;
+  if (spacing.isSet()) {
+    auto bytes = parseSize(spacing.getValue());
+    if (!bytes || !*bytes) {
+      std::cerr << "-s specified, but '" << spacing.getValue()
+                << "' is not a size." << std::endl;
+      return 1;
+    }
+    options.spacing = *bytes;
+  } else if (latency.isSet()) {
+    options.spacing = std::numeric_limits<size_t>::max();
+  }
+  options.latency = std::chrono::milliseconds(latency.getValue());
+  options.jobs = jobs.getValue();
+  options.auEncoded = auEncoded.getValue();
+
   // TODO support stdin
-  return zindexFile(path.getValue(), indexFile);
+  return zindexFile(path.getValue(), indexFile, options);
 }
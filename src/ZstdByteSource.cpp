@@ -0,0 +1,220 @@
+#include "ZstdByteSource.h"
+#include "au/ParseError.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef AU_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// the seekable format is described in zstd's
+// contrib/seekable_format/zstd_seekable_compression_format.md
+
+namespace {
+
+constexpr uint32_t SeekableMagic = 0x8F92EAB1;
+constexpr uint32_t SeekTableMagic = 0x184D2A5E; // a skippable frame
+constexpr size_t SkippableHeaderSize = 8;
+constexpr size_t FooterSize = 9;
+
+uint32_t readLE32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | static_cast<uint32_t>(p[3]) << 24;
+}
+
+void preadFully(int fd, void *buf, size_t len, size_t offset,
+                const std::string &fname) {
+  auto n = ::pread(fd, buf, len, offset);
+  if (n < 0)
+    THROW_RT("pread: " << strerror(errno) << " (" << fname << ")");
+  if (static_cast<size_t>(n) != len)
+    THROW_RT("Truncated seekable zstd file " << fname);
+}
+
+struct Fd {
+  int fd;
+  explicit Fd(const std::string &fname) : fd(::open(fname.c_str(), O_RDONLY)) {}
+  ~Fd() { if (fd != -1) ::close(fd); }
+  Fd(const Fd &) = delete;
+  Fd &operator=(const Fd &) = delete;
+};
+
+}
+
+class ZstdByteSource::Impl {
+  struct Frame {
+    uint64_t compressedOffset;
+    uint64_t uncompressedOffset;
+  };
+
+  std::string fname_;
+  Fd fd_;
+  /// Each frame's start, then the end of the last one
+  std::vector<Frame> frames_;
+
+  uint64_t pos_ = 0; // uncompressed position of the next byte read
+  uint64_t compressedPos_ = 0; // of the next read into input_
+#ifdef AU_HAVE_ZSTD
+  ZSTD_DCtx *dctx_ = nullptr;
+  std::unique_ptr<uint8_t[]> input_;
+  ZSTD_inBuffer in_{nullptr, 0, 0};
+#endif
+
+  void loadSeekTable() {
+    struct stat stat;
+    if (fstat(fd_.fd, &stat) < 0)
+      THROW_RT("failed to stat file: " << strerror(errno));
+    uint64_t size = stat.st_size;
+    uint8_t footer[FooterSize];
+    if (size < sizeof(footer))
+      THROW_RT(fname_ << " is not a seekable zstd file");
+    preadFully(fd_.fd, footer, sizeof(footer), size - sizeof(footer), fname_);
+    if (readLE32(footer + 5) != SeekableMagic)
+      THROW_RT(fname_ << " is not a seekable zstd file");
+    auto descriptor = footer[4];
+    if (descriptor & 0x7c)
+      THROW_RT("Unsupported seek table in " << fname_);
+    uint64_t numFrames = readLE32(footer);
+    uint64_t entrySize = descriptor & 0x80 ? 12 : 8; // with checksums or not
+    uint64_t tableSize = SkippableHeaderSize + numFrames * entrySize;
+    if (tableSize + FooterSize > size)
+      THROW_RT("Corrupt seek table in " << fname_);
+    std::vector<uint8_t> table(tableSize);
+    auto dataEnd = size - tableSize - FooterSize;
+    preadFully(fd_.fd, table.data(), table.size(), dataEnd, fname_);
+    if (readLE32(&table[0]) != SeekTableMagic
+        || readLE32(&table[4]) != tableSize + FooterSize - SkippableHeaderSize)
+      THROW_RT("Corrupt seek table in " << fname_);
+
+    Frame frame{0, 0};
+    frames_.reserve(numFrames + 1);
+    for (auto *entry = &table[SkippableHeaderSize];
+         entry != table.data() + table.size(); entry += entrySize) {
+      frames_.push_back(frame);
+      frame.compressedOffset += readLE32(entry);
+      frame.uncompressedOffset += readLE32(entry + 4);
+    }
+    frames_.push_back(frame);
+    if (frame.compressedOffset != dataEnd)
+      THROW_RT("Seek table doesn't match the frames in " << fname_);
+  }
+
+public:
+  explicit Impl(const std::string &fname) : fname_(fname), fd_(fname) {
+    if (fd_.fd == -1)
+      THROW_RT("open: " << strerror(errno) << " (" << fname << ")");
+    loadSeekTable();
+#ifdef AU_HAVE_ZSTD
+    dctx_ = ZSTD_createDCtx();
+    if (!dctx_) THROW_RT("Unable to create zstd context");
+    input_.reset(new uint8_t[ZSTD_DStreamInSize()]);
+    in_ = ZSTD_inBuffer{input_.get(), 0, 0};
+#else
+    THROW_RT("Can't read " << fname << ": au was built without zstd");
+#endif
+  }
+
+  ~Impl() {
+#ifdef AU_HAVE_ZSTD
+    ZSTD_freeDCtx(dctx_);
+#endif
+  }
+
+  std::vector<size_t> accessPoints() const {
+    std::vector<size_t> result;
+    for (auto &frame : frames_) result.push_back(frame.uncompressedOffset);
+    return result;
+  }
+
+  size_t endPos() const { return frames_.back().uncompressedOffset; }
+
+  size_t doRead(char *buf, size_t len) {
+    if (pos_ >= endPos()) return 0;
+#ifdef AU_HAVE_ZSTD
+    // zstd carries on from one frame into the next by itself. we just mustn't
+    // feed it the seek table.
+    ZSTD_outBuffer out{buf, len, 0};
+    for (;;) {
+      // zstd consumes a whole block before handing out its output in pieces,
+      // so ask for what it's already decoded before giving it more input.
+      auto ret = ZSTD_decompressStream(dctx_, &out, &in_);
+      if (ZSTD_isError(ret))
+        THROW_RT("zstd: " << ZSTD_getErrorName(ret) << " (" << fname_ << ")");
+      if (out.pos) break;
+      if (in_.pos == in_.size) {
+        auto toRead = std::min(ZSTD_DStreamInSize(),
+                               frames_.back().compressedOffset - compressedPos_);
+        if (!toRead) THROW_RT("Truncated zstd frame in " << fname_);
+        preadFully(fd_.fd, input_.get(), toRead, compressedPos_, fname_);
+        compressedPos_ += toRead;
+        in_ = ZSTD_inBuffer{input_.get(), toRead, 0};
+      }
+    }
+    pos_ += out.pos;
+    return out.pos;
+#else
+    (void)buf;
+    (void)len;
+    return 0;
+#endif
+  }
+
+  void doSeek(size_t abspos) {
+    auto frame = std::upper_bound(
+        frames_.begin(), frames_.end() - 1, abspos,
+        [](size_t abspos, const Frame &frame) {
+          return abspos < frame.uncompressedOffset;
+        }) - 1;
+    // carry on from where we are if that's no further from abspos than the
+    // start of its frame.
+    if (abspos < pos_ || pos_ < frame->uncompressedOffset) {
+#ifdef AU_HAVE_ZSTD
+      ZSTD_DCtx_reset(dctx_, ZSTD_reset_session_only);
+      in_ = ZSTD_inBuffer{input_.get(), 0, 0};
+#endif
+      compressedPos_ = frame->compressedOffset;
+      pos_ = frame->uncompressedOffset;
+    }
+    char discardBuffer[32768];
+    while (pos_ < abspos) {
+      auto numRead = doRead(discardBuffer,
+                            std::min(sizeof(discardBuffer), abspos - pos_));
+      if (!numRead) THROW_RT("Unable to skip any bytes!");
+    }
+  }
+};
+
+ZstdByteSource::ZstdByteSource(const std::string &fname)
+    : FileByteSource(fname, false), impl_(std::make_unique<Impl>(fname)) {}
+
+ZstdByteSource::~ZstdByteSource() {}
+
+bool ZstdByteSource::isSeekableZstd(const std::string &fname) {
+  Fd fd(fname);
+  struct stat stat;
+  if (fd.fd == -1 || fstat(fd.fd, &stat) < 0 || !S_ISREG(stat.st_mode)
+      || stat.st_size < static_cast<off_t>(FooterSize))
+    return false;
+  uint8_t magic[4];
+  auto n = ::pread(fd.fd, magic, sizeof(magic), stat.st_size - sizeof(magic));
+  return n == sizeof(magic) && readLE32(magic) == SeekableMagic;
+}
+
+std::vector<size_t> ZstdByteSource::accessPoints() const {
+  return impl_->accessPoints();
+}
+
+size_t ZstdByteSource::doRead(char *buf, size_t len) {
+  return impl_->doRead(buf, len);
+}
+
+size_t ZstdByteSource::endPos() const {
+  return impl_->endPos();
+}
+
+void ZstdByteSource::doSeek(size_t abspos) {
+  impl_->doSeek(abspos);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "au/AuDecoder.h"
+
+#include <memory>
+#include <vector>
+
+/// Reads zstd's seekable format: independent zstd frames, followed by a seek
+/// table (in a skippable frame) of each frame's compressed and decompressed
+/// sizes. Unlike a gzipped file, it needs no separate index, and decompression
+/// can start at the start of any frame.
+class ZstdByteSource : public FileByteSource {
+  class Impl;
+  std::unique_ptr<Impl> impl_;
+public:
+  explicit ZstdByteSource(const std::string &fname);
+  ~ZstdByteSource();
+
+  /// Whether the file ends in a seekable zstd seek table
+  static bool isSeekableZstd(const std::string &fname);
+
+  /// Uncompressed positions of the frames' starts
+  std::vector<size_t> accessPoints() const;
+
+  size_t doRead(char *buf, size_t len) override;
+  size_t endPos() const override;
+  void doSeek(size_t abspos) override;
+};
@@ -0,0 +1,198 @@
+#pragma once
+
+#include "au/AuBatchWriter.h"
+#include "au/ParseError.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+/// How an AuAsyncWriter batches what it writes.
+struct AuAsyncWriterOptions {
+  /// Writes a batch once it's this big...
+  size_t batchSize = 1024 * 1024;
+  /// ...or once its first record has waited this long.
+  std::chrono::microseconds maxDelay = std::chrono::milliseconds(100);
+  /// Most bytes buffered before the caller has to wait for the writing to
+  /// catch up.
+  size_t maxBuffered = 64 * 1024 * 1024;
+};
+
+/// A write function for AuEncoder::encode() that leaves the writing to a
+/// background thread. Records are copied into a batch of chunks, and the
+/// thread writes each batch with one writev() once it's batchSize bytes, or
+/// maxDelay after its first record, whichever comes first. All the caller
+/// pays is the copy, under a lock the background thread only holds to take
+/// the batch.
+///
+///   AuAsyncWriter writer(fd);
+///   encoder.encode([&](AuWriter &w) { ... }, writer);
+///   writer.close();
+///
+/// Call from one thread at a time, as for AuEncoder itself. The fd isn't
+/// closed.
+class AuAsyncWriter {
+  static constexpr size_t ChunkSize = 64 * 1024;
+
+  struct Chunk {
+    std::unique_ptr<char[]> data;
+    size_t len = 0;
+  };
+
+  using Clock = std::chrono::steady_clock;
+
+  const int fd_;
+  const AuAsyncWriterOptions options_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;     //< For the background thread
+  std::condition_variable doneCv_; //< For callers waiting on it
+  // all of these are guarded by mutex_
+  std::vector<Chunk> batch_;  //< The last one is being filled
+  std::vector<Chunk> free_;   //< Written chunks, to reuse
+  size_t batchBytes_ = 0;
+  size_t writingBytes_ = 0;   //< Being written, outside the lock
+  Clock::time_point batchStart_;
+  size_t accepted_ = 0;       //< Total bytes passed to write()
+  size_t written_ = 0;        //< Total bytes written or failed to be
+  size_t flushTo_ = 0;        //< Write at least this much now
+  bool stop_ = false;
+  int error_ = 0;
+
+  std::thread writer_;
+
+public:
+  explicit AuAsyncWriter(int fd,
+                         AuAsyncWriterOptions options = {})
+      : fd_(fd), options_(options) {
+    writer_ = std::thread([this] { run(); });
+  }
+
+  /// Writes whatever's left. Call close() first to find out if that failed.
+  ~AuAsyncWriter() {
+    try {
+      close();
+    } catch (std::exception &) {}
+  }
+
+  AuAsyncWriter(const AuAsyncWriter &) = delete;
+  AuAsyncWriter &operator=(const AuAsyncWriter &) = delete;
+
+  /// As passed to AuEncoder::encode().
+  /// @return the number of bytes taken
+  ssize_t operator()(std::string_view dict, std::string_view value) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (stop_) THROW_RT("Write after close");
+    auto len = dict.size() + value.size();
+    auto fits = [&] {
+      auto buffered = batchBytes_ + writingBytes_;
+      return !buffered || buffered + len <= options_.maxBuffered;
+    };
+    if (!fits()) {
+      flushTo_ = accepted_;
+      cv_.notify_one();
+      doneCv_.wait(lock, [&] { return error_ || fits(); });
+    }
+    checkError();
+    auto prevBytes = batchBytes_;
+    if (!prevBytes) batchStart_ = Clock::now();
+    append(dict);
+    append(value);
+    accepted_ += len;
+    // the thread needs waking to start timing a new batch, and to write a
+    // full one. otherwise it's already waiting for one or the other.
+    if (!prevBytes
+        || (prevBytes < options_.batchSize
+            && batchBytes_ >= options_.batchSize)) {
+      lock.unlock();
+      cv_.notify_one();
+    }
+    return static_cast<ssize_t>(len);
+  }
+
+  /// Waits until everything taken so far is written.
+  void flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    flushTo_ = accepted_;
+    cv_.notify_one();
+    doneCv_.wait(lock, [this] { return error_ || written_ >= flushTo_; });
+    checkError();
+  }
+
+  /// Writes everything taken so far, and stops the background thread. No
+  /// more can be written after.
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stop_) return;
+      stop_ = true;
+    }
+    cv_.notify_one();
+    writer_.join();
+    std::lock_guard<std::mutex> lock(mutex_);
+    checkError();
+  }
+
+private:
+  void checkError() {
+    if (error_) THROW_RT("Error writing: " << strerror(error_));
+  }
+
+  void append(std::string_view data) {
+    while (!data.empty()) {
+      if (batch_.empty() || batch_.back().len == ChunkSize) {
+        if (free_.empty()) {
+          batch_.push_back(Chunk{std::make_unique<char[]>(ChunkSize), 0});
+        } else {
+          batch_.push_back(std::move(free_.back()));
+          free_.pop_back();
+        }
+      }
+      auto &chunk = batch_.back();
+      auto n = std::min(data.size(), ChunkSize - chunk.len);
+      ::memcpy(chunk.data.get() + chunk.len, data.data(), n);
+      chunk.len += n;
+      batchBytes_ += n;
+      data.remove_prefix(n);
+    }
+  }
+
+  void run() {
+    std::vector<Chunk> writing;
+    std::vector<iovec> iov;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this] { return stop_ || batchBytes_; });
+      if (!batchBytes_) return; // stopped, and all written
+      cv_.wait_until(lock, batchStart_ + options_.maxDelay, [this] {
+        return stop_ || batchBytes_ >= options_.batchSize
+            || flushTo_ > written_;
+      });
+      writing.swap(batch_);
+      writingBytes_ = batchBytes_;
+      batchBytes_ = 0;
+      lock.unlock();
+      iov.clear();
+      for (auto &chunk : writing) iov.push_back({chunk.data.get(), chunk.len});
+      // after an error, the rest is dropped, as there's no telling what
+      // made it
+      auto error = error_ ? error_ : auWritevAll(fd_, iov.data(), iov.size());
+      lock.lock();
+      if (error) error_ = error;
+      written_ += writingBytes_;
+      writingBytes_ = 0;
+      for (auto &chunk : writing) {
+        chunk.len = 0;
+        free_.push_back(std::move(chunk));
+      }
+      writing.clear();
+      doneCv_.notify_all();
+    }
+  }
+};
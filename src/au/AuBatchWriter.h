@@ -0,0 +1,103 @@
+#pragma once
+
+#include "au/ParseError.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <string_view>
+#include <vector>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/// Writes all of iov, however many writev() calls it takes.
+/// @return 0, or the errno it failed with
+inline int auWritevAll(int fd, iovec *iov, size_t count) {
+  auto *end = iov + count;
+  while (iov != end) {
+    auto num = static_cast<int>(std::min<size_t>(end - iov, IOV_MAX));
+    auto written = ::writev(fd, iov, num);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return errno;
+    }
+    // skip what was written, which may end part way through an iovec
+    auto n = static_cast<size_t>(written);
+    while (iov != end && n >= iov->iov_len) n -= iov++->iov_len;
+    if (n) {
+      iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+/// A write function for AuEncoder::encode() that writes to a file descriptor
+/// with one writev() per batch of records. Small records are copied into the
+/// batch. A large value is written straight from the encoder's buffer, along
+/// with the batch so far and its own dictionary records, so it isn't copied
+/// at all.
+///
+///   AuBatchWriter writer(fd);
+///   encoder.encode([&](AuWriter &w) { ... }, writer);
+///   writer.flush();
+///
+/// Anything not yet written when it's destroyed is written then, but errors
+/// are only reported by flush() and the write function itself. The fd isn't
+/// closed.
+class AuBatchWriter {
+  /// Values this big are worth a syscall of their own rather than a copy
+  static constexpr size_t MinUncopiedSize = 16 * 1024;
+
+  int fd_;
+  size_t batchSize_;
+  std::vector<char> batch_;
+
+public:
+  explicit AuBatchWriter(int fd, size_t batchSize = 256 * 1024)
+      : fd_(fd), batchSize_(batchSize) {
+    batch_.reserve(batchSize_);
+  }
+
+  ~AuBatchWriter() {
+    try {
+      flush();
+    } catch (std::exception &) {}
+  }
+
+  AuBatchWriter(const AuBatchWriter &) = delete;
+  AuBatchWriter &operator=(const AuBatchWriter &) = delete;
+
+  /// As passed to AuEncoder::encode().
+  /// @return the number of bytes taken
+  ssize_t operator()(std::string_view dict, std::string_view value) {
+    if (value.size() >= MinUncopiedSize) {
+      iovec iov[] = {
+          {batch_.data(), batch_.size()},
+          {const_cast<char *>(dict.data()), dict.size()},
+          {const_cast<char *>(value.data()), value.size()}};
+      clearBatch(auWritevAll(fd_, iov, 3));
+    } else {
+      batch_.insert(batch_.end(), dict.begin(), dict.end());
+      batch_.insert(batch_.end(), value.begin(), value.end());
+      if (batch_.size() >= batchSize_) flush();
+    }
+    return static_cast<ssize_t>(dict.size() + value.size());
+  }
+
+  /// Writes whatever's waiting in the batch.
+  void flush() {
+    if (batch_.empty()) return;
+    iovec iov{batch_.data(), batch_.size()};
+    clearBatch(auWritevAll(fd_, &iov, 1));
+  }
+
+private:
+  /// Clears the batch, even if writing it failed, so that it isn't written
+  /// again.
+  void clearBatch(int error) {
+    batch_.clear();
+    if (error) THROW_RT("Error writing: " << strerror(error));
+  }
+};
@@ -2,6 +2,7 @@
 
 #include <cstdint>
 #include <cstdlib>
+#include <string_view>
 
 namespace FormatVersion1 {
 
@@ -37,3 +38,14 @@ enum SmallInt : uint8_t {
 };
 
 }
+
+/// FNV-1a, which unlike std::hash can be constexpr, and doesn't change from
+/// one build to the next
+constexpr uint64_t fnv1a(std::string_view str) {
+  uint64_t result = 0xcbf29ce484222325;
+  for (auto c : str) {
+    result ^= static_cast<unsigned char>(c);
+    result *= 0x100000001b3;
+  }
+  return result;
+}
@@ -17,8 +17,20 @@
 #include <unistd.h>
 #include <cstddef>
 #include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <variant>
+#include <thread>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <poll.h>
+#ifdef __linux__
+#include <libgen.h>
+#include <sys/inotify.h>
+#include <sys/vfs.h>
+#endif
 
 // TODO add position/expectation info to all error messages
 
@@ -42,6 +54,17 @@ public:
         buf_(new char[BUFFER_SIZE]),
         pos_(0), cur_(buf_), limit_(buf_), waitForData_(waitForData) {}
 
+protected:
+  /// For subclasses which expose the stream in place (see MmapByteSource)
+  /// rather than refilling a working buffer. Such subclasses must set buf_,
+  /// cur_ and limit_ themselves, and override refill().
+  explicit FileByteSource(const std::string &fname)
+      : BUFFER_SIZE(0),
+        name_(fname),
+        buf_(nullptr),
+        pos_(0), cur_(nullptr), limit_(nullptr), waitForData_(false) {}
+
+public:
   FileByteSource(const FileByteSource &) = delete;
   FileByteSource(FileByteSource &&) = delete;
   FileByteSource &operator=(const FileByteSource &) = delete;
@@ -56,6 +79,10 @@ public:
 
   virtual size_t endPos() const = 0;
 
+  /// Position in the stream of the start of the file now being read. Non-zero
+  /// only once a followed file has been rotated or truncated.
+  virtual size_t fileStartPos() const { return 0; }
+
   class Byte {
     int value_;
   public:
@@ -93,13 +120,13 @@ public:
   };
 
   Byte next() {
-    while (cur_ == limit_) if (!read()) return Byte::Eof();
+    while (cur_ == limit_) if (!refill()) return Byte::Eof();
     pos_++;
     return Byte(*cur_++);
   }
 
   Byte peek() {
-    while (cur_ == limit_) if (!read()) return Byte::Eof();
+    while (cur_ == limit_) if (!refill()) return Byte::Eof();
     return Byte(*cur_);
   }
 
@@ -116,7 +143,7 @@ public:
   void read(size_t len, F func) {
     while (len) {
       while (cur_ == limit_)
-        if (!read())
+        if (!refill())
           THROW("reached eof while trying to read " << len << " bytes");
       // limit_ > cur_, so cast to size_t is fine...
       auto first = std::min(len, static_cast<size_t>(limit_ - cur_));
@@ -135,22 +162,25 @@ public:
   virtual size_t doRead(char *buf, size_t len) = 0;
 
   void seek(size_t abspos) {
-    if (abspos < pos_ && pos_ - abspos <= static_cast<size_t>(cur_ - buf_)) {
-      auto relseek = pos_ - abspos;
-      cur_ -= relseek;
-      pos_ -= relseek;
+    auto bufStartPos = pos_ - static_cast<size_t>(cur_ - buf_);
+    if (abspos >= bufStartPos && abspos <= pos_ + buffAvail()) {
+      // the target is already in the working buffer, either in the retained
+      // history or not yet consumed. the underlying source stays where it is.
+      cur_ = buf_ + (abspos - bufStartPos);
+      pos_ = abspos;
     } else {
       doSeek(abspos);
       cur_ = limit_ = buf_;
       pos_ = abspos;
-      if (!read())
+      if (!refill())
         THROW_RT("failed to read from new location");
     }
   }
 
   bool seekTo(std::string_view needle) {
     while (true) {
-      if (buffAvail() < needle.length()) return false;
+      while (buffAvail() < needle.length())
+        if (!refill()) return false;
       auto found = memmem(cur_, buffAvail(), needle.data(), needle.length());
       if (found) {
         size_t offset = static_cast<char *>(found) - cur_;
@@ -158,30 +188,35 @@ public:
         cur_ += offset;
         return true;
       } else {
-        // TODO for zipped files where seeking may expensive, it'll be better
-        // perhaps to copy the last few bytes to the start of buffer and just
-        // read again, since they're contiguous reads and we're not really seeking.
-        // but the zipped file source may hide that anyway using a context like
-        // zindex does
+        // skip to very near the end of the buffer, leaving just len(needle)-1
+        // bytes in case the needle straddles the boundary. that's a seek
+        // within the working buffer, so the top of the loop then refills it
+        // (contiguously, which also suits zipped sources where a real seek
+        // would be expensive). the contract is that the underlying source can
+        // return any non-zero number of bytes on a read(), but it won't return
+        // 0 unless it really actually has no more bytes to give us, so we give
+        // up only once the refill fails.
         skip(buffAvail()-(needle.length()-1));
-        // we might have attempted to find 'needle' and failed. then we seek to
-        // very near the end of the buffer, leaving just len(needle)-1 bytes.
-        // the seek automatically clears the buffer and re-reads, but the
-        // UNDERLYING source might just return the same few bytes again, in
-        // which case we'll fail on the next iteration. the contract is that
-        // the underlying source can return any non-zero number of bytes on a
-        // read(), but it won't return 0 unless it really actually has no more
-        // bytes to give us. therefore...
-
-        // make one last desperate attempt to refill the buffer before going
-        // around again. this is a crappy way of doing this, but given the
-        // current design, it's the simplest solution. this whole thing should
-        // be refactored...
-        read();
       }
     }
   }
 
+  /// A view of the next len bytes, without consuming them. May refill the
+  /// working buffer to make them contiguous.
+  /// @return nullopt if the bytes don't fit in the working buffer, or the
+  /// stream ends first.
+  std::optional<std::string_view> peekBytes(size_t len) {
+    // a mapped source (BUFFER_SIZE 0) can always widen its window.
+    // otherwise refill() always keeps BUFFER_SIZE/16 of history.
+    if (buffAvail() < len
+        && (!BUFFER_SIZE || len <= BUFFER_SIZE - BUFFER_SIZE / 16)) {
+      while (buffAvail() < len)
+        if (!refill()) break;
+    }
+    if (buffAvail() < len) return std::nullopt;
+    return std::string_view(cur_, len);
+  }
+
   /// Seek to length bytes from the end of the stream
   void tail(size_t length) {
     auto end = endPos();
@@ -201,8 +236,14 @@ private:
   }
 
 protected:
+  /// Called when waiting for data and the underlying source has none. Returns
+  /// when there may be more, after which the source is read again.
+  virtual void awaitData() {
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+  }
+
   /// @return true if some data was read, false of 0 bytes were read.
-  bool read() {
+  virtual bool refill() {
     return read(BUFFER_SIZE / 16);
   }
 
@@ -226,7 +267,7 @@ private:
       if (bytesRead < 0) // TODO: && errno != EAGAIN ?
         THROW_RT("Error reading file: " << strerror(errno));
       if (bytesRead == 0 && waitForData_)
-        sleep(1);
+        awaitData();
     } while (!bytesRead && waitForData_);
 
     if (!bytesRead) return false;
@@ -237,11 +278,29 @@ private:
 
 class FileByteSourceImpl : public FileByteSource {
   int fd_;
+  /// Stream position corresponding to the start of the file currently open.
+  /// Non-zero only after following the path to a rotated or truncated file.
+  size_t fileStartPos_ = 0;
+  std::chrono::milliseconds pollInterval_;
+  int inotifyFd_ = -1;
+  int fileWatch_ = -1;
 
 public:
+  /**
+   * @param waitForData Follow the file as it grows: at end of file, wait for
+   * more data rather than reporting eof. If the file is rotated (the path now
+   * refers to a different file) or truncated, the new contents continue the
+   * stream where the old ones left off.
+   * @param pollInterval When following, the longest we wait before checking
+   * the file again. Where inotify is available it wakes us as soon as the
+   * file changes, and this is only a fallback.
+   */
   explicit FileByteSourceImpl(const std::string &fname, bool waitForData,
-                              size_t bufferSizeInK = 256)
-      : FileByteSource(fname, waitForData, bufferSizeInK) {
+                              size_t bufferSizeInK = 256,
+                              std::chrono::milliseconds pollInterval
+                                  = std::chrono::seconds(1))
+      : FileByteSource(fname, waitForData, bufferSizeInK),
+        pollInterval_(pollInterval) {
     if (fname == "-") {
       fd_ = fileno(stdin);
     } else {
@@ -251,30 +310,431 @@ public:
       THROW_RT("open: " << strerror(errno) << " (" << fname << ")");
 #ifndef __APPLE__
     ::posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);  // TODO report error?
+#endif
+#ifdef __linux__
+    if (waitForData && fname != "-") {
+      // failure here isn't fatal: we just fall back to polling
+      inotifyFd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+      if (inotifyFd_ != -1) {
+        watchFile();
+        // a rotation usually creates the replacement file right after moving
+        // the old one away. watch the directory so we see it appear.
+        std::vector<char> path(fname.begin(), fname.end());
+        path.push_back(0);
+        inotify_add_watch(inotifyFd_, dirname(path.data()),
+                          IN_CREATE | IN_MOVED_TO);
+      }
+    }
 #endif
   }
 
   ~FileByteSourceImpl() {
+    if (inotifyFd_ != -1) close(inotifyFd_);
     close(fd_); // TODO report error?
   }
 
   size_t doRead(char *buf, size_t len) override {
-    return ::read(fd_, buf, len);
+    auto bytesRead = ::read(fd_, buf, len);
+    if (bytesRead == 0 && waitForData_ && reopenIfReplaced())
+      bytesRead = ::read(fd_, buf, len);
+    return bytesRead;
   }
 
   size_t endPos() const override {
     struct stat stat;
     if (auto res = fstat(fd_, &stat); res < 0)
       THROW_RT("failed to stat file: " << strerror(errno));
-    return stat.st_size;
+    return fileStartPos_ + stat.st_size;
   }
 
+  size_t fileStartPos() const override { return fileStartPos_; }
+
   void doSeek(size_t abspos) override {
-    auto pos = lseek(fd_, static_cast<off_t>(abspos), SEEK_SET);
+    if (abspos < fileStartPos_)
+      THROW_RT("failed to seek to " << abspos << ": data before position "
+               << fileStartPos_ << " was in a file which has since been "
+               "rotated or truncated");
+    auto pos = lseek(fd_, static_cast<off_t>(abspos - fileStartPos_),
+                     SEEK_SET);
     if (pos < 0) {
       THROW_RT("failed to seek to desired location: " << strerror(errno));
     }
   }
+
+protected:
+  void awaitData() override {
+#ifdef __linux__
+    if (inotifyFd_ != -1) {
+      pollfd pfd{inotifyFd_, POLLIN, 0};
+      if (::poll(&pfd, 1, static_cast<int>(pollInterval_.count())) > 0) {
+        // we don't care which event it was, the caller will just try again
+        char events[4096];
+        while (::read(inotifyFd_, events, sizeof(events)) > 0) {}
+      }
+      return;
+    }
+#endif
+    std::this_thread::sleep_for(pollInterval_);
+  }
+
+private:
+  void watchFile() {
+#ifdef __linux__
+    if (inotifyFd_ == -1) return;
+    if (fileWatch_ != -1) inotify_rm_watch(inotifyFd_, fileWatch_);
+    fileWatch_ = inotify_add_watch(
+        inotifyFd_, name_.c_str(),
+        IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+#endif
+  }
+
+  /// Called at end of file when following. If the path has been rotated to a
+  /// new file, or the file has been truncated, continue the stream from the
+  /// start of the (new) file.
+  /// @return true if the stream now continues from a different place.
+  bool reopenIfReplaced() {
+    if (name_ == "<stdin>") return false;
+    struct stat byPath, current;
+    if (::stat(name_.c_str(), &byPath) != 0 || fstat(fd_, &current) != 0)
+      return false; // no replacement (yet)
+    auto offset = lseek(fd_, 0, SEEK_CUR);
+    if (offset < 0) return false;
+
+    if (byPath.st_dev == current.st_dev && byPath.st_ino == current.st_ino) {
+      if (current.st_size >= offset) return false;
+      // truncated: start again at the beginning of the same file
+      lseek(fd_, 0, SEEK_SET);
+    } else {
+      // anything written to the old file before it was rotated comes first
+      char c;
+      if (::pread(fd_, &c, 1, offset) == 1) return false;
+      int fd = ::open(name_.c_str(), O_RDONLY);
+      if (fd == -1) return false;
+      close(fd_);
+      fd_ = fd;
+      watchFile();
+    }
+    fileStartPos_ += static_cast<size_t>(offset);
+    std::cerr << "au: " << name_ << " was rotated or truncated; continuing at "
+              << "the start of the new file\n";
+    return true;
+  }
+};
+
+/// Serves a regular file from a read-only memory mapping. There is no working
+/// buffer to refill: the mapping is handed out a window at a time, so
+/// read(len, func) is a single fragment pointing into the mapping unless it
+/// crosses a window, and seeking anywhere in the file is just pointer
+/// arithmetic. Not suitable for files that are still growing.
+///
+/// Touching a page past the end of a file that's shrunk since it was mapped
+/// raises SIGBUS, which would kill the process. The file's size is checked
+/// before each window is handed out, and a parse_error thrown if it's shrunk,
+/// but a file that shrinks part way through a window can still do that. Only
+/// use this where SIGBUS is handled, or can't happen (see openFileByteSource).
+class MmapByteSource : public FileByteSource {
+  int fd_;
+  size_t size_;
+  const size_t windowSize_;
+
+public:
+  /// @param sequential The caller is going to read the file through from
+  /// start to finish, so the kernel should read well ahead of it.
+  explicit MmapByteSource(const std::string &fname, bool sequential = false,
+                          size_t windowSizeInK = 1024)
+      : FileByteSource(fname), size_(0), windowSize_(windowSizeInK * 1024) {
+    fd_ = ::open(fname.c_str(), O_RDONLY);
+    if (fd_ == -1)
+      THROW_RT("open: " << strerror(errno) << " (" << fname << ")");
+    size_ = fileSize();
+    if (size_) {
+      auto *addr = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+      if (addr == MAP_FAILED) {
+        auto err = errno;
+        close(fd_);
+        THROW_RT("mmap: " << strerror(err) << " (" << fname << ")");
+      }
+      // only a hint: without it the kernel's default read-around applies,
+      // which suits random access (e.g. bisecting) better anyway
+      if (sequential) (void)::madvise(addr, size_, MADV_SEQUENTIAL);
+      buf_ = static_cast<char *>(addr);
+    }
+    cur_ = limit_ = buf_;
+  }
+
+  ~MmapByteSource() {
+    if (buf_) ::munmap(buf_, size_);
+    buf_ = nullptr; // not ours for the base class to delete
+    close(fd_);
+  }
+
+  size_t doRead(char *, size_t) override { return 0; }
+
+  size_t endPos() const override { return size_; }
+
+  void doSeek(size_t abspos) override {
+    // seek() then refills from pos_, which is all the mapping needs
+    if (abspos > size_)
+      THROW_RT("failed to seek to " << abspos << ": past end of file ("
+                                    << size_ << " bytes)");
+  }
+
+protected:
+  bool refill() override {
+    // cur_ always matches pos_, except right after a seek() outside the
+    // current window, which leaves both at the start of the mapping
+    auto windowEnd = static_cast<size_t>(limit_ - buf_);
+    if (windowEnd < pos_) windowEnd = pos_;
+    if (windowEnd == size_) return false;
+    if (auto size = fileSize(); size < size_)
+      THROW(name_ << " was truncated while being read (from " << size_
+                  << " to " << size << " bytes)");
+    cur_ = buf_ + pos_;
+    limit_ = buf_ + std::min(size_, windowEnd + windowSize_);
+    return true;
+  }
+
+private:
+  size_t fileSize() const {
+    struct stat stat;
+    if (fstat(fd_, &stat) < 0)
+      THROW_RT("failed to stat file: " << strerror(errno));
+    return static_cast<size_t>(stat.st_size);
+  }
+};
+
+/// Reads ahead of the consumer on a background thread, so that I/O on the
+/// underlying file overlaps with parsing. The producer fills a ring of chunks
+/// while the consumer copies out of the oldest one; seeking discards whatever
+/// has been read ahead and restarts the producer at the new position. Seeking
+/// back within the working buffer's history doesn't involve the producer at
+/// all. Meant for sequential consumers of files where reads are slow, such as
+/// on network filesystems; doesn't support following. It can read a pipe, but
+/// then destroying it waits for the read in progress, which may be never, so
+/// openFileByteSource() doesn't use it for those.
+class ReadAheadByteSource : public FileByteSource {
+  struct Chunk {
+    std::unique_ptr<char[]> data;
+    size_t len = 0;
+  };
+
+  int fd_;
+  bool seekable_;
+  const size_t chunkSize_;
+  std::vector<Chunk> chunks_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  // all of these are guarded by mutex_
+  size_t head_ = 0;     //< Oldest filled chunk, the one being consumed
+  size_t count_ = 0;    //< Number of filled chunks
+  size_t consumed_ = 0; //< Bytes already consumed from the head chunk
+  size_t readPos_ = 0;  //< Where the producer reads next
+  uint64_t generation_ = 0; //< Bumped by every seek
+  bool eof_ = false;
+  bool stop_ = false;
+  int error_ = 0;
+
+  std::thread producer_;
+
+public:
+  explicit ReadAheadByteSource(const std::string &fname,
+                               size_t bufferSizeInK = 256,
+                               size_t chunkSizeInK = 1024,
+                               size_t numChunks = 4)
+      : FileByteSource(fname, false, bufferSizeInK),
+        chunkSize_(chunkSizeInK * 1024),
+        chunks_(numChunks) {
+    if (fname == "-") {
+      fd_ = fileno(stdin);
+    } else {
+      fd_ = ::open(fname.c_str(), O_RDONLY);
+    }
+    if (fd_ == -1)
+      THROW_RT("open: " << strerror(errno) << " (" << fname << ")");
+#ifndef __APPLE__
+    ::posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);  // TODO report error?
+#endif
+    auto pos = lseek(fd_, 0, SEEK_CUR);
+    seekable_ = pos >= 0;
+    // positions are offsets in the file, as for pread() and endPos(), even
+    // if we're handed it part way through
+    if (seekable_) readPos_ = pos_ = static_cast<size_t>(pos);
+    for (auto &chunk : chunks_) chunk.data.reset(new char[chunkSize_]);
+    producer_ = std::thread([this] { produce(); });
+  }
+
+  ~ReadAheadByteSource() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    producer_.join();
+    close(fd_); // TODO report error?
+  }
+
+  size_t doRead(char *buf, size_t len) override {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return count_ || eof_ || error_; });
+    if (!count_) {
+      if (!error_) return 0;
+      errno = error_;
+      return static_cast<size_t>(-1);
+    }
+    auto &chunk = chunks_[head_];
+    auto n = std::min(len, chunk.len - consumed_);
+    // the producer never touches a filled chunk, so no need to hold the lock
+    // while copying. only this thread changes head_ and consumed_.
+    lock.unlock();
+    ::memcpy(buf, chunk.data.get() + consumed_, n);
+    lock.lock();
+    consumed_ += n;
+    if (consumed_ == chunk.len) {
+      consumed_ = 0;
+      head_ = (head_ + 1) % chunks_.size();
+      count_--;
+      lock.unlock();
+      cv_.notify_all();
+    }
+    return n;
+  }
+
+  size_t endPos() const override {
+    struct stat stat;
+    if (auto res = fstat(fd_, &stat); res < 0)
+      THROW_RT("failed to stat file: " << strerror(errno));
+    return stat.st_size;
+  }
+
+  void doSeek(size_t abspos) override {
+    if (!seekable_)
+      THROW_RT("failed to seek to desired location: " << strerror(ESPIPE));
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      generation_++;
+      head_ = count_ = consumed_ = 0;
+      readPos_ = abspos;
+      eof_ = false;
+      error_ = 0;
+    }
+    cv_.notify_all();
+  }
+
+private:
+  void produce() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this] {
+        return stop_ || (count_ < chunks_.size() && !eof_ && !error_);
+      });
+      if (stop_) return;
+      auto &chunk = chunks_[(head_ + count_) % chunks_.size()];
+      auto generation = generation_;
+      auto readPos = readPos_;
+      lock.unlock();
+      // the consumer can't see this chunk until count_ is bumped, so it's
+      // safe to fill it without the lock
+      auto bytesRead = seekable_
+          ? ::pread(fd_, chunk.data.get(), chunkSize_,
+                    static_cast<off_t>(readPos))
+          : ::read(fd_, chunk.data.get(), chunkSize_);
+      auto err = errno;
+      lock.lock();
+      if (generation != generation_) continue; // seeked meanwhile: discard
+      if (bytesRead < 0) {
+        error_ = err;
+      } else if (bytesRead == 0) {
+        eof_ = true;
+      } else {
+        chunk.len = static_cast<size_t>(bytesRead);
+        readPos_ += chunk.len;
+        count_++;
+      }
+      cv_.notify_all();
+    }
+  }
+};
+
+/// True if fname is on a filesystem where reads are slow enough that reading
+/// ahead is worthwhile, i.e. a network or FUSE filesystem.
+inline bool isRemoteFile([[maybe_unused]] const std::string &fname) {
+#ifdef __linux__
+  struct statfs fs;
+  if (::statfs(fname.c_str(), &fs) != 0) return false;
+  switch (static_cast<uint32_t>(fs.f_type)) {
+    case 0x6969:     // NFS_SUPER_MAGIC
+    case 0x517b:     // SMB_SUPER_MAGIC
+    case 0xff534d42: // CIFS_MAGIC_NUMBER
+    case 0xfe534d42: // SMB2_MAGIC_NUMBER
+    case 0x65735546: // FUSE_SUPER_MAGIC
+      return true;
+    default:
+      return false;
+  }
+#else
+  return false;
+#endif
+}
+
+/// Opens the most efficient source for fname. If the caller allows it, regular
+/// files on local disk which aren't going to be followed are memory-mapped. If
+/// the caller is going to read sequentially, remote files and a stdin
+/// redirected from a file are read ahead on a background thread. Anything else
+/// (including pipes) is read through a working buffer.
+/// @param sequential The caller is going to read through from the start, so
+/// reading ahead is worthwhile.
+/// @param mmap Allow an MmapByteSource: only if the process handles SIGBUS
+/// (see there), which the library doesn't do on its behalf.
+inline std::unique_ptr<FileByteSource>
+openFileByteSource(const std::string &fname, bool waitForData,
+                   bool sequential = false, bool mmap = false) {
+  if (waitForData)
+    return std::make_unique<FileByteSourceImpl>(fname, waitForData);
+  bool isStdin = fname == "-";
+  struct stat stat;
+  bool regular = (isStdin ? ::fstat(STDIN_FILENO, &stat)
+                          : ::stat(fname.c_str(), &stat)) == 0
+      && S_ISREG(stat.st_mode);
+  bool remote = regular && !isStdin && isRemoteFile(fname);
+  if (mmap && regular && !isStdin && !remote && stat.st_size > 0)
+    return std::make_unique<MmapByteSource>(fname, sequential);
+  if (sequential && regular && (remote || isStdin))
+    return std::make_unique<ReadAheadByteSource>(fname);
+  return std::make_unique<FileByteSourceImpl>(fname, waitForData);
+}
+
+/// Accumulates the fragments of a string. A string which arrives as a single
+/// fragment (usual for buffered sources, and nearly always the case for an
+/// MmapByteSource) is referenced in place instead of being copied. The view is
+/// only valid until the source is next read from.
+class StringFragments {
+  std::vector<char> buf_;
+  std::string_view view_;
+  size_t len_ = 0;
+
+public:
+  explicit StringFragments(size_t reserve = 1u << 16) {
+    buf_.reserve(reserve);
+  }
+
+  void start(size_t len) {
+    len_ = len;
+    view_ = std::string_view();
+    buf_.clear();
+  }
+
+  void append(std::string_view frag) {
+    if (buf_.empty() && frag.size() == len_) {
+      view_ = frag;
+      return;
+    }
+    if (buf_.empty()) buf_.reserve(len_);
+    buf_.insert(buf_.end(), frag.data(), frag.data() + frag.size());
+    view_ = std::string_view(buf_.data(), buf_.size());
+  }
+
+  std::string_view view() const { return view_; }
 };
 
 class StringBuilder {
@@ -630,58 +1090,106 @@ private:
   }
 };
 
+/// No-op ValueParser callbacks, for handlers that want only some of them.
+/// Derive as `struct H : NoopValueHandler<H>` and define just those. The
+/// callbacks aren't virtual: ValueParser<H> calls H's directly, so they inline
+/// into its loop.
+template <typename Derived>
 struct NoopValueHandler {
-  virtual ~NoopValueHandler() = default;
-
-  virtual void onObjectStart() {}
-  virtual void onObjectEnd() {}
-  virtual void onArrayStart() {}
-  virtual void onArrayEnd() {}
-  virtual void onNull([[maybe_unused]] size_t pos) {}
-  virtual void onBool([[maybe_unused]] size_t pos, bool) {}
-  virtual void onInt([[maybe_unused]] size_t pos, int64_t) {}
-  virtual void onUint([[maybe_unused]] size_t pos, uint64_t) {}
-  virtual void onDouble([[maybe_unused]] size_t pos, double) {}
-  virtual void onTime(
+  void onObjectStart() {}
+  void onObjectEnd() {}
+  void onArrayStart() {}
+  void onArrayEnd() {}
+  void onNull([[maybe_unused]] size_t pos) {}
+  void onBool([[maybe_unused]] size_t pos, bool) {}
+  void onInt([[maybe_unused]] size_t pos, int64_t) {}
+  void onUint([[maybe_unused]] size_t pos, uint64_t) {}
+  void onDouble([[maybe_unused]] size_t pos, double) {}
+  void onTime(
       [[maybe_unused]] size_t pos,
       [[maybe_unused]] std::chrono::system_clock::time_point nanos) {}
-  virtual void onDictRef([[maybe_unused]] size_t pos,
-                         [[maybe_unused]] size_t dictIdx) {}
-  virtual void onStringStart([[maybe_unused]] size_t sov,
-                             [[maybe_unused]] size_t length) {}
-  virtual void onStringEnd() {}
-  virtual void onStringFragment([[maybe_unused]] std::string_view fragment) {}
+  void onDictRef([[maybe_unused]] size_t pos,
+                 [[maybe_unused]] size_t dictIdx) {}
+  void onStringStart([[maybe_unused]] size_t sov,
+                     [[maybe_unused]] size_t length) {}
+  void onStringEnd() {}
+  void onStringFragment([[maybe_unused]] std::string_view fragment) {}
+
+protected:
+  // what `override` would check: a callback of Derived's with the wrong
+  // signature would quietly leave the no-op in place. not deleted through.
+  ~NoopValueHandler() {
+    using D = Derived;
+    using T = std::chrono::system_clock::time_point;
+    (void)static_cast<void (D::*)()>(&D::onObjectStart);
+    (void)static_cast<void (D::*)()>(&D::onObjectEnd);
+    (void)static_cast<void (D::*)()>(&D::onArrayStart);
+    (void)static_cast<void (D::*)()>(&D::onArrayEnd);
+    (void)static_cast<void (D::*)(size_t)>(&D::onNull);
+    (void)static_cast<void (D::*)(size_t, bool)>(&D::onBool);
+    (void)static_cast<void (D::*)(size_t, int64_t)>(&D::onInt);
+    (void)static_cast<void (D::*)(size_t, uint64_t)>(&D::onUint);
+    (void)static_cast<void (D::*)(size_t, double)>(&D::onDouble);
+    (void)static_cast<void (D::*)(size_t, T)>(&D::onTime);
+    (void)static_cast<void (D::*)(size_t, size_t)>(&D::onDictRef);
+    (void)static_cast<void (D::*)(size_t, size_t)>(&D::onStringStart);
+    (void)static_cast<void (D::*)()>(&D::onStringEnd);
+    (void)static_cast<void (D::*)(std::string_view)>(&D::onStringFragment);
+  }
 };
 
+/// No-op RecordParser callbacks, which skip over value records. As with
+/// NoopValueHandler, derive as `struct H : NoopRecordHandler<H>`.
+template <typename Derived>
 struct NoopRecordHandler {
-  virtual ~NoopRecordHandler() = default;
-
-  virtual void onRecordStart([[maybe_unused]] size_t absPos) {}
-  virtual void onValue([[maybe_unused]]size_t relDictPos, size_t len,
-                       FileByteSource &source) {
+  void onRecordStart([[maybe_unused]] size_t absPos) {}
+  void onValue([[maybe_unused]] size_t relDictPos, size_t len,
+               FileByteSource &source) {
     source.skip(len);
   }
-  virtual void onHeader([[maybe_unused]] uint64_t version,
-                        [[maybe_unused]] const std::string &metadata) {}
-  virtual void onDictClear() {}
-  virtual void onDictAddStart([[maybe_unused]] size_t relDictPos) {}
-  virtual void onStringStart([[maybe_unused]] size_t strLen) {}
-  virtual void onStringEnd() {}
-  virtual void onStringFragment([[maybe_unused]] std::string_view fragment) {}
+  void onHeader([[maybe_unused]] uint64_t version,
+                [[maybe_unused]] const std::string &metadata) {}
+  void onDictClear() {}
+  void onDictAddStart([[maybe_unused]] size_t relDictPos) {}
+  void onStringStart([[maybe_unused]] size_t sov,
+                     [[maybe_unused]] size_t length) {}
+  void onStringEnd() {}
+  void onStringFragment([[maybe_unused]] std::string_view fragment) {}
+
+protected:
+  ~NoopRecordHandler() {
+    using D = Derived;
+    (void)static_cast<void (D::*)(size_t)>(&D::onRecordStart);
+    (void)static_cast<void (D::*)(size_t, size_t, FileByteSource &)>(
+        &D::onValue);
+    (void)static_cast<void (D::*)(uint64_t, const std::string &)>(
+        &D::onHeader);
+    (void)static_cast<void (D::*)()>(&D::onDictClear);
+    (void)static_cast<void (D::*)(size_t)>(&D::onDictAddStart);
+    (void)static_cast<void (D::*)(size_t, size_t)>(&D::onStringStart);
+    (void)static_cast<void (D::*)()>(&D::onStringEnd);
+    (void)static_cast<void (D::*)(std::string_view)>(&D::onStringFragment);
+  }
 };
 
+/// Decodes a whole file, from the most efficient source openFileByteSource()
+/// has for it.
 class AuDecoder {
   std::string filename_;
+  bool mmap_;
 
 public:
-  AuDecoder(const std::string &filename)
-      : filename_(filename) {}
+  /// @param mmap Memory-map the file where possible: only where the process
+  /// handles SIGBUS (see MmapByteSource), which the library doesn't do on its
+  /// behalf.
+  explicit AuDecoder(const std::string &filename, bool mmap = false)
+      : filename_(filename), mmap_(mmap) {}
 
   template<typename H>
   void decode(H &handler, bool waitForData) const {
-    FileByteSourceImpl source(filename_, waitForData);
+    auto source = openFileByteSource(filename_, waitForData, true, mmap_);
     try {
-      RecordParser<H>(source, handler).parseStream();
+      RecordParser<H>(*source, handler).parseStream();
     } catch (parse_error &e) {
       std::cerr << e.what() << std::endl;
     }
@@ -1,14 +1,16 @@
 #pragma once
 
 #include "au/AuCommon.h"
+#include "au/AuStringStore.h"
 
 #include <algorithm>
 #include <chrono>
+#include <cstring>
 #include <ctime>
-#include <list>
 #include <map>
 #include <memory>
 #include <optional>
+#include <string>
 #include <string_view>
 #include <unordered_map>
 #include <vector>
@@ -16,109 +18,289 @@
 
 class AuEncoder;
 
+/// A key known at compile time, for AuWriter::key() and map(). Declare it
+/// constexpr, e.g.
+///
+///   static constexpr AuKey Price("price");
+///   writer.map(Price, 101.25);
+///
+/// so that its hash is worked out at compile time. Each AuStringIntern caches
+/// what it interned the key as, so that, until the dictionary next changes
+/// other than by growing, writing the key again is just writing its
+/// reference.
+class AuKey {
+  std::string_view str_;
+  uint64_t hash_;
+
+public:
+  /// str has to outlive every encoder that the key is written with, as a
+  /// string literal does.
+  template<size_t N>
+  constexpr explicit AuKey(const char (&str)[N])
+      : str_(str, N - 1), hash_(fnv1a(str_)) {}
+
+  constexpr std::string_view str() const { return str_; }
+  constexpr uint64_t hash() const { return hash_; }
+};
+
 class AuStringIntern {
+public:
+  /// Never 0, which UsageTracker uses to mark a free slot
+  static uint64_t hash(std::string_view str) {
+    auto h = static_cast<uint64_t>(std::hash<std::string_view>()(str));
+    return h ? h : 1;
+  }
+
+private:
+
+  /// Counts uses of strings which aren't (yet) interned, so the frequent ones
+  /// can be. Tracks up to INTERN_CACHE_SIZE strings, forgetting the one first
+  /// seen longest ago to make room for another. Strings are only known by a
+  /// 64-bit hash, so nothing is allocated per string: the table and the ring
+  /// recording the order strings were first seen in are allocated up front.
+  /// A hash collision just means a string gets interned a little early.
   class UsageTracker {
-    using InOrder = std::list<std::string>;
-    InOrder inOrder_;
-
-    using DictVal = std::pair<size_t, InOrder::iterator>;
-    using Dict = std::unordered_map<std::string_view, DictVal>;
-    Dict dict_;
-
-    void pop(Dict::iterator it) {
-      if (it != dict_.end()) {
-        auto listIt = it->second.second;
-        dict_.erase(it);
-        inOrder_.erase(listIt);
+    struct Slot {
+      uint64_t hash; // 0 for an empty slot
+      size_t count;
+      uint64_t seq; // when it was first seen, i.e. its place in order_
+    };
+
+    std::vector<Slot> slots_; // open addressing, a power of two in size
+    std::vector<uint64_t> order_; // a ring of hashes by seq, some stale
+    uint64_t head_ = 0; // seq of the oldest entry in order_
+    uint64_t tail_ = 0; // seq of the next one
+    size_t size_ = 0;
+
+    size_t mask() const { return slots_.size() - 1; }
+
+    Slot *find(uint64_t h) {
+      for (auto i = h & mask();; i = (i + 1) & mask()) {
+        if (slots_[i].hash == h) return &slots_[i];
+        if (!slots_[i].hash) return nullptr;
       }
     }
 
+    void erase(Slot *slot) {
+      // backward shift deletion: close the gap by moving up any later entry
+      // in the probe sequence which could live in it. no tombstones.
+      auto gap = static_cast<size_t>(slot - slots_.data());
+      for (auto i = (gap + 1) & mask(); slots_[i].hash; i = (i + 1) & mask()) {
+        auto home = slots_[i].hash & mask();
+        if (((i - home) & mask()) >= ((i - gap) & mask())) {
+          slots_[gap] = slots_[i];
+          gap = i;
+        }
+      }
+      slots_[gap].hash = 0;
+      size_--;
+    }
+
+    /// The ring entry for seq is stale if its string has since been interned
+    /// or evicted (and perhaps seen again later, with a later seq).
+    Slot *live(uint64_t seq) {
+      auto *slot = find(order_[seq % order_.size()]);
+      return slot && slot->seq == seq ? slot : nullptr;
+    }
+
+    void evictOldest() {
+      while (true) {
+        auto *slot = live(head_++);
+        if (slot) {
+          erase(slot);
+          return;
+        }
+      }
+    }
+
+    /// Drops the stale entries from the ring, renumbering the live ones.
+    void compact() {
+      auto to = head_;
+      for (auto from = head_; from != tail_; from++) {
+        if (auto *slot = live(from)) {
+          order_[to % order_.size()] = slot->hash;
+          slot->seq = to++;
+        }
+      }
+      tail_ = to;
+    }
+
   public:
     const size_t INTERN_THRESH;
     const size_t INTERN_CACHE_SIZE;
 
     UsageTracker(size_t internThresh, size_t internCacheSize)
-        : INTERN_THRESH(internThresh), INTERN_CACHE_SIZE(internCacheSize) {}
+        : INTERN_THRESH(internThresh), INTERN_CACHE_SIZE(internCacheSize) {
+      // at most half full
+      size_t capacity = 2;
+      while (capacity < 2 * internCacheSize) capacity *= 2;
+      slots_.resize(capacity);
+      // with twice the room needed, compact() is needed at most once for
+      // every internCacheSize strings interned.
+      order_.resize(std::max<size_t>(2 * internCacheSize, 1));
+    }
 
-    bool shouldIntern(const std::string &str) {
-      auto it = dict_.find(std::string_view(str.c_str(), str.length()));
-      if (it != dict_.end()) {
-        if (it->second.first >= INTERN_THRESH) {
-          pop(it);
+    /// Counts a use of the string with hash h
+    bool shouldIntern(uint64_t h) {
+      if (!INTERN_CACHE_SIZE) return false;
+      if (auto *slot = find(h)) {
+        if (slot->count >= INTERN_THRESH) {
+          erase(slot);
           return true;
         } else {
-          it->second.first++;
+          slot->count++;
           return false;
         }
-      } else {
-        if (inOrder_.size() >= INTERN_CACHE_SIZE) {
-          const auto &s = inOrder_.front();
-          pop(dict_.find(std::string_view(s.c_str(), s.length())));
-        }
-        inOrder_.emplace_back(str);
-        const auto &s = inOrder_.back();
-        std::string_view sv(s.c_str(), s.length());
-        dict_[sv] = {size_t(1), --(inOrder_.end())};
-        return false;
       }
+
+      if (size_ >= INTERN_CACHE_SIZE) evictOldest();
+      if (tail_ - head_ == order_.size()) compact();
+      order_[tail_ % order_.size()] = h;
+      auto i = h & mask();
+      while (slots_[i].hash) i = (i + 1) & mask();
+      slots_[i] = Slot{h, 1, tail_++};
+      size_++;
+      return false;
     }
 
     void clear() {
-      dict_.clear();
-      inOrder_.clear();
+      std::fill(slots_.begin(), slots_.end(), Slot{0, 0, 0});
+      head_ = tail_ = 0;
+      size_ = 0;
     }
 
     size_t size() const {
-      return dict_.size();
+      return size_;
     }
   };
 
-  struct InternEntry {
+  /// A slot in index_. It's empty unless gen is index_'s current generation.
+  struct Slot {
+    uint64_t hash;
     size_t internIndex;
-    size_t occurences;
+    uint64_t gen;
   };
 
-  std::vector<std::string> dictInOrder_;
-  /// The string and its intern index
-  std::unordered_map<std::string, InternEntry> dictionary_;
+  /// The interned strings, by intern index. Purged strings stay until the
+  /// next reIndex() or clear().
+  AuStringStore dictInOrder_;
+  std::vector<size_t> occurences_; // by intern index
+  /// An open-addressing table of intern indices, at most half full. Clearing
+  /// it just starts a new generation, so nothing is freed per string.
+  std::vector<Slot> index_;
+  uint64_t gen_ = 1;
+  size_t size_ = 0;
+
+  /// What an AuKey was interned as, while gen is index_'s generation. A key
+  /// is only known by its string's address, length and hash, as the string
+  /// itself may be gone.
+  struct KeySlot {
+    const char *data;
+    size_t len;
+    uint64_t hash;
+    uint64_t gen;
+    std::optional<size_t> internIndex;
+  };
+  static constexpr size_t KeyCacheSize = 256;
+  std::vector<KeySlot> keyCache_; // by AuKey::hash(), once there's a key
   const size_t tinyStringSize_;
   UsageTracker internCache_;
 
+  size_t mask() const { return index_.size() - 1; }
+  bool used(const Slot &slot) const { return slot.gen == gen_; }
+
+  Slot *find(uint64_t h, std::string_view s) {
+    for (auto i = h & mask();; i = (i + 1) & mask()) {
+      auto &slot = index_[i];
+      if (!used(slot)) return nullptr;
+      if (slot.hash == h && dictInOrder_[slot.internIndex] == s) return &slot;
+    }
+  }
+
+  void insert(uint64_t h, size_t internIndex) {
+    if (2 * (size_ + 1) > index_.size()) {
+      std::vector<Slot> old(2 * index_.size(), Slot{0, 0, 0});
+      old.swap(index_);
+      size_ = 0;
+      for (auto &slot : old)
+        if (used(slot)) insert(slot.hash, slot.internIndex);
+    }
+    auto i = h & mask();
+    while (used(index_[i])) i = (i + 1) & mask();
+    index_[i] = Slot{h, internIndex, gen_};
+    size_++;
+  }
+
+  void resetIndex() {
+    gen_++;
+    size_ = 0;
+  }
+
+  std::vector<Slot> usedSlots() const {
+    std::vector<Slot> result;
+    result.reserve(size_);
+    for (auto &slot : index_)
+      if (used(slot)) result.push_back(slot);
+    return result;
+  }
+
 public:
   explicit AuStringIntern(size_t tinyStr = 4, size_t internThresh = 10,
                           size_t internCacheSize = 1000)
-      : tinyStringSize_(tinyStr),
+      : index_(64, Slot{0, 0, 0}),
+        tinyStringSize_(tinyStr),
         internCache_(internThresh, internCacheSize) {}
 
-  std::optional<size_t> idx(std::string s, std::optional<bool> intern) {
+  std::optional<size_t> idx(std::string_view s, std::optional<bool> intern) {
+    if (s.length() <= tinyStringSize_) return {std::nullopt};
+    if (intern.has_value() && !intern.value()) return {std::nullopt};
+    return idx(s, intern, hash(s));
+  }
+
+  /// As idx(s, intern), where h is already known to be hash(s).
+  std::optional<size_t> idx(std::string_view s, std::optional<bool> intern,
+                            uint64_t h) {
     if (s.length() <= tinyStringSize_) return {std::nullopt};
     if (intern.has_value() && !intern.value()) return {std::nullopt};
 
-    auto it = dictionary_.find(s);
-    if (it != dictionary_.end()) {
-      it->second.occurences++;
-      return it->second.internIndex;
+    if (auto *slot = find(h, s)) {
+      occurences_[slot->internIndex]++;
+      return slot->internIndex;
     }
 
     bool forceIntern = intern.has_value() && intern.value();
-    if (forceIntern || internCache_.shouldIntern(s)) {
+    if (forceIntern || internCache_.shouldIntern(h)) {
       auto nextEntry = dictInOrder_.size();
-      dictionary_[s] = {nextEntry, 1};
-      dictInOrder_.emplace_back(s);
+      dictInOrder_.push_back(s);
+      occurences_.push_back(1);
+      insert(h, nextEntry);
       return nextEntry;
     }
     return {std::nullopt};
   }
 
-  auto idx(std::string_view sv, std::optional<bool> intern) {
-    return idx(std::string(sv), intern);
+  /// As idx(key.str(), true), but with the result cached for next time.
+  std::optional<size_t> idx(const AuKey &key) {
+    if (keyCache_.empty())
+      keyCache_.resize(KeyCacheSize, KeySlot{nullptr, 0, 0, 0, std::nullopt});
+    auto str = key.str();
+    auto &slot = keyCache_[key.hash() & (KeyCacheSize - 1)];
+    if (slot.gen == gen_ && slot.hash == key.hash() && slot.data == str.data()
+        && slot.len == str.size()) {
+      if (slot.internIndex) occurences_[*slot.internIndex]++;
+      return slot.internIndex;
+    }
+    auto result = idx(str, true);
+    slot = KeySlot{str.data(), str.size(), key.hash(), gen_, result};
+    return result;
   }
 
-  const std::vector<std::string> &dict() const { return dictInOrder_; }
+  const AuStringStore &dict() const { return dictInOrder_; }
 
   void clear(bool clearUsageTracker) {
-    dictionary_.clear();
+    resetIndex();
     dictInOrder_.clear();
+    occurences_.clear();
     if (clearUsageTracker) internCache_.clear();
   }
 
@@ -126,16 +308,12 @@ public:
   size_t purge(size_t threshold) {
     // Note: We can't modify dictInOrder_ or else the internIndex will no longer
     // match.
-    size_t purged = 0;
-    for (auto it = dictionary_.begin(); it != dictionary_.end();) {
-      if (it->second.occurences < threshold) {
-        it = dictionary_.erase(it);
-        purged++;
-      } else {
-        ++it;
-      }
-    }
-    return purged;
+    auto slots = usedSlots();
+    resetIndex();
+    for (auto &slot : slots)
+      if (occurences_[slot.internIndex] >= threshold)
+        insert(slot.hash, slot.internIndex);
+    return slots.size() - size_;
   }
 
   /// Purges the dictionary and re-idexes the remaining entries so the more
@@ -143,21 +321,24 @@ public:
   size_t reIndex(size_t threshold) {
     size_t purged = purge(threshold);
 
-    dictInOrder_.clear();
-    dictInOrder_.reserve(dictionary_.size());
-    for (auto &pr : dictionary_) {
-      dictInOrder_.emplace_back(pr.first);
-    }
-
-    std::sort(dictInOrder_.begin(), dictInOrder_.end(),
+    auto slots = usedSlots();
+    std::sort(slots.begin(), slots.end(),
               [this](const auto &a, const auto &b) {
                 // Invert comparison b/c we want frequent strings first
-                return dictionary_[a].occurences > dictionary_[b].occurences;
+                return occurences_[a.internIndex] > occurences_[b.internIndex];
               });
-    size_t idx = 0;
-    for (auto &v : dictInOrder_) {
-      dictionary_[v].internIndex = idx++;
+
+    AuStringStore dictInOrder;
+    std::vector<size_t> occurences;
+    occurences.reserve(slots.size());
+    resetIndex();
+    for (auto &slot : slots) {
+      insert(slot.hash, dictInOrder.size());
+      dictInOrder.push_back(dictInOrder_[slot.internIndex]);
+      occurences.push_back(occurences_[slot.internIndex]);
     }
+    std::swap(dictInOrder_, dictInOrder);
+    occurences_.swap(occurences);
 
     return purged;
   }
@@ -165,64 +346,143 @@ public:
   // For debug/profiling
   auto getStats() const {
     return std::unordered_map<std::string, int> {
-        {"HashBucketCount", dictionary_.bucket_count()},
-        {"HashLoadFactor",  dictionary_.load_factor()},
-        {"MaxLoadFactor",   dictionary_.max_load_factor()},
-        {"HashSize",        dictionary_.size()},
+        {"HashBucketCount", index_.size()},
+        {"HashLoadFactor",  static_cast<float>(size_) / index_.size()},
+        {"MaxLoadFactor",   0.5f},
+        {"HashSize",        size_},
         {"DictSize",        dictInOrder_.size()},
         {"CacheSize",       internCache_.size()}
     };
   }
 };
 
+/// A growable byte buffer. Besides put() and write(), bytes can be written
+/// straight through the pointer from reserve(), so that encoding a scalar is
+/// one capacity check and then plain stores.
 class AuVectorBuffer {
-  std::vector<char> v;
+  std::unique_ptr<char[]> data_;
+  size_t size_ = 0;
+  size_t capacity_;
+
+  void grow(size_t needed) {
+    auto capacity = std::max(needed, 2 * capacity_);
+    std::unique_ptr<char[]> data(new char[capacity]);
+    if (size_) ::memcpy(data.get(), data_.get(), size_);
+    data_ = std::move(data);
+    capacity_ = capacity;
+  }
+
 public:
-  AuVectorBuffer(size_t size = 1024) {
-    v.reserve(size);
+  AuVectorBuffer(size_t size = 1024)
+      : data_(new char[size]), capacity_(size) {}
+
+  /// Makes room for n more bytes, and returns where they go. Write up to n
+  /// bytes there, then pass the end of them to commit().
+  char *reserve(size_t n) {
+    if (capacity_ - size_ < n) grow(size_ + n);
+    return data_.get() + size_;
   }
+  void commit(const char *end) {
+    size_ = static_cast<size_t>(end - data_.get());
+  }
+
   void put(char c) {
-    v.push_back(c);
+    *reserve(1) = c;
+    size_++;
   }
   void write(const char *data, size_t size) {
-    v.insert(v.end(), data, data + size);
+    if (!size) return;
+    ::memcpy(reserve(size), data, size);
+    size_ += size;
   }
   size_t tellp() {
-    return v.size();
+    return size_;
   }
   std::string_view str() {
-    return std::string_view(v.data(), v.size());
+    return std::string_view(data_.get(), size_);
   }
   void clear() {
-    v.clear();
+    size_ = 0;
   }
 };
 
+/// A string that an AuWriter with no dictionary wrote inline, for
+/// AuEncoder::encodeDeferred() to intern if it should be.
+struct AuDeferredString {
+  size_t pos; // where its encoding starts
+  size_t strPos; // where the string itself starts, after its marker
+  size_t len;
+  std::optional<bool> intern;
+  uint64_t hash; // AuStringIntern::hash() of it
+};
+
 class AuWriter {
   AuVectorBuffer &msgBuf_;
-  AuStringIntern &stringIntern_;
+  AuStringIntern *stringIntern_;
+  std::vector<AuDeferredString> *deferred_ = nullptr;
+
+  static constexpr size_t MaxVarintSize = 10;
+
+  /// Writes the varint encoding of i at p, returning the end of it
+  static char *putVarint(char *p, uint64_t i) {
+    while (i >= 0x80) {
+      *p++ = static_cast<char>((i & 0x7fu) | 0x80u);
+      i >>= 7;
+    }
+    *p++ = static_cast<char>(i);
+    return p;
+  }
+
+  void markedVarint(char marker, uint64_t i) {
+    auto *p = msgBuf_.reserve(1 + MaxVarintSize);
+    *p++ = marker;
+    msgBuf_.commit(putVarint(p, i));
+  }
+
+  template<typename T>
+  void markedFixed(char marker, T val) {
+    static_assert(sizeof(val) == 8);
+    auto *p = msgBuf_.reserve(1 + sizeof(val));
+    *p = marker;
+    ::memcpy(p + 1, &val, sizeof(val));
+    msgBuf_.commit(p + 1 + sizeof(val));
+  }
 
   void encodeString(const std::string_view sv) {
     static constexpr size_t MaxInlineStringSize = 31;
-    if (sv.length() <= MaxInlineStringSize) {
-      msgBuf_.put(0x20 | sv.length());
+    auto len = sv.length();
+    auto *p = msgBuf_.reserve(1 + MaxVarintSize + len);
+    if (len <= MaxInlineStringSize) {
+      *p++ = static_cast<char>(0x20 | len);
     } else {
-      msgBuf_.put(marker::String);
-      valueInt(sv.length());
+      *p++ = marker::String;
+      p = putVarint(p, len);
     }
-    msgBuf_.write(sv.data(), sv.length());
+    if (len) ::memcpy(p, sv.data(), len);
+    msgBuf_.commit(p + len);
   }
 
   void encodeStringIntern(const std::string_view sv,
                           std::optional<bool> intern) {
-    auto idx = stringIntern_.idx(sv, intern);
+    if (!stringIntern_) {
+      auto pos = msgBuf_.tellp();
+      encodeString(sv);
+      auto end = msgBuf_.tellp();
+      deferred_->push_back({pos, end - sv.length(), sv.length(), intern,
+                            AuStringIntern::hash(sv)});
+      return;
+    }
+    encodeInterned(sv, stringIntern_->idx(sv, intern));
+  }
+
+  /// Encodes sv as a reference to dictionary entry idx, if it's in it.
+  void encodeInterned(const std::string_view sv, std::optional<size_t> idx) {
     if (!idx) {
       encodeString(sv);
     } else if (*idx < 0x80) {
       msgBuf_.put(0x80 | *idx);
     } else {
-      msgBuf_.put(marker::DictRef);
-      valueInt(*idx);
+      markedVarint(marker::DictRef, *idx);
     }
   }
 
@@ -254,7 +514,11 @@ class AuWriter {
 
 public:
   AuWriter(AuVectorBuffer &buf, AuStringIntern &stringIntern)
-      : msgBuf_(buf), stringIntern_(stringIntern) {}
+      : msgBuf_(buf), stringIntern_(&stringIntern) {}
+  /// A writer with no dictionary: the strings it would intern are written
+  /// inline and noted in deferred, for AuEncoder::encodeDeferred().
+  AuWriter(AuVectorBuffer &buf, std::vector<AuDeferredString> &deferred)
+      : msgBuf_(buf), stringIntern_(nullptr), deferred_(&deferred) {}
   virtual ~AuWriter() = default;
 
   class KeyValSink {
@@ -266,6 +530,10 @@ public:
     void operator()(std::string_view key, V &&val) {
       writer_.kvs(key, std::forward<V>(val));
     }
+    template<typename V>
+    void operator()(const AuKey &key, V &&val) {
+      writer_.kvs(key, std::forward<V>(val));
+    }
   };
 
   template<typename... Args>
@@ -323,6 +591,12 @@ public:
   void key(std::string_view key) {
     encodeStringIntern(key, true);
   }
+  void key(const AuKey &key) {
+    if (stringIntern_)
+      encodeInterned(key.str(), stringIntern_->idx(key));
+    else
+      encodeStringIntern(key.str(), true);
+  }
 
   AuWriter &null() {
     msgBuf_.put(marker::Null);
@@ -377,18 +651,12 @@ public:
   template<class T>
   AuWriter &value(T f,
                   typename std::enable_if<std::is_floating_point<T>::value>::type * = nullptr) {
-    double d = static_cast<double>(f);
-    static_assert(sizeof(d) == 8);
-    msgBuf_.put(marker::Double);
-    auto *dPtr = reinterpret_cast<char *>(&d);
-    msgBuf_.write(dPtr, sizeof(d));
+    markedFixed(marker::Double, static_cast<double>(f));
     return *this;
   }
 
   AuWriter &nanos(uint64_t n) {
-    msgBuf_.put(marker::Timestamp);
-    auto *dPtr = reinterpret_cast<char *>(&n);
-    msgBuf_.write(dPtr, sizeof(n));
+    markedFixed(marker::Timestamp, n);
     return *this;
   }
 
@@ -429,21 +697,14 @@ protected:
   }
 
   void valueInt(uint64_t i) {
-    while (true) {
-      char toWrite = static_cast<char>(i & 0x7fu);
-      i >>= 7;
-      if (i) {
-        msgBuf_.put((toWrite | static_cast<char>(0x80u)));
-      } else {
-        msgBuf_.put(toWrite);
-        break;
-      }
-    }
+    msgBuf_.commit(putVarint(msgBuf_.reserve(MaxVarintSize), i));
   }
 
   void term() {
-    msgBuf_.put(marker::RecordEnd);
-    msgBuf_.put('\n');
+    auto *p = msgBuf_.reserve(2);
+    p[0] = marker::RecordEnd;
+    p[1] = '\n';
+    msgBuf_.commit(p + 2);
   }
 
 private:
@@ -454,6 +715,12 @@ private:
     value(std::forward<V>(val));
     kvs(std::forward<Args>(args)...);
   }
+  template<typename V, typename... Args>
+  void kvs(const AuKey &key, V &&val, Args &&... args) {
+    this->key(key);
+    value(std::forward<V>(val));
+    kvs(std::forward<Args>(args)...);
+  }
 
   void vals() {}
   template<typename V, typename... Args>
@@ -482,22 +749,18 @@ private:
         neg = true;
       }
       if (val >= 1ull << 48) {
-        msgBuf_.put(neg ? marker::NegInt64 : marker::PosInt64);
-        msgBuf_.write(reinterpret_cast<char *>(&val), sizeof(val));
+        markedFixed(neg ? marker::NegInt64 : marker::PosInt64, val);
         return *this;
       }
-      msgBuf_.put(neg ? marker::NegVarint : marker::Varint);
-      valueInt(static_cast<typename std::make_unsigned<T>::type>(val));
+      markedVarint(neg ? marker::NegVarint : marker::Varint,
+                   static_cast<typename std::make_unsigned<T>::type>(val));
     } else {
       if (i < 32) {
         msgBuf_.put(marker::SmallInt::Positive | i);
       } else if (i >= 1ull << 48) {
-        msgBuf_.put(marker::PosInt64);
-        uint64_t val = i;
-        msgBuf_.write(reinterpret_cast<char *>(&val), sizeof(val));
+        markedFixed(marker::PosInt64, static_cast<uint64_t>(i));
       } else {
-        msgBuf_.put(marker::Varint);
-        valueInt(i);
+        markedVarint(marker::Varint, i);
       }
     }
     return *this;
@@ -528,10 +791,8 @@ class AuEncoder {
       AuWriter af(dictBuf_, stringIntern_);
       af.raw('A');
       af.backref(backref_);
-      for (size_t i = lastDictSize_; i < dict.size(); ++i) {
-        auto &s = dict[i];
-        af.value(std::string_view(s.c_str(), s.length()), false);
-      }
+      for (size_t i = lastDictSize_; i < dict.size(); ++i)
+        af.value(dict[i], false);
       af.term();
       backref_ = dictBuf_.tellp() - sor;
       lastDictSize_ = dict.size();
@@ -618,6 +879,26 @@ public:
     return result;
   }
 
+  /// Encodes a value that an AuWriter with no dictionary wrote, interning the
+  /// strings it deferred as encode() would have.
+  template<typename W>
+  ssize_t encodeDeferred(std::string_view value,
+                         const std::vector<AuDeferredString> &deferred,
+                         W &&write) {
+    if (value.empty()) return 0;
+    AuWriter writer(buf_, stringIntern_);
+    size_t done = 0;
+    for (auto &str : deferred) {
+      buf_.write(value.data() + done, str.pos - done);
+      auto sv = value.substr(str.strPos, str.len);
+      writer.encodeInterned(sv, stringIntern_.idx(sv, str.intern, str.hash));
+      done = str.strPos + str.len;
+    }
+    buf_.write(value.data() + done, value.size() - done);
+    writer.term();
+    return finalizeAndWrite(write);
+  }
+
   void clearDictionary(bool clearUsageTracker = false) {
     stringIntern_.clear(clearUsageTracker);
     emitDictClear();
@@ -0,0 +1,175 @@
+#pragma once
+
+#include "au/AuEncoder.h"
+
+#include <atomic>
+#include <utility>
+
+/// An AuEncoder front end that any number of threads can encode records into
+/// at once, without a lock. Each thread encodes through its own Producer into
+/// a buffer of its own, and hands the finished record over through a
+/// lock-free queue. A single writer thread calls drain() to intern their
+/// strings and write them out.
+///
+/// The dictionary is only ever touched by the writer: producers write every
+/// string inline and note the ones that could be interned, and drain() swaps
+/// those for dictionary references as AuEncoder::encode() would have. Records
+/// from one Producer are written in the order they were encoded.
+class AuMultiProducerEncoder {
+  struct Record {
+    std::atomic<Record *> next{nullptr};
+    AuVectorBuffer buf;
+    std::vector<AuDeferredString> deferred;
+  };
+
+  AuEncoder encoder_;
+
+  // Vyukov's intrusive MPSC queue. producers push at head_, the writer pops
+  // at tail_. stub_ keeps it from ever being empty, so a push never has to
+  // touch tail_.
+  Record stub_;
+  std::atomic<Record *> head_{&stub_};
+  Record *tail_ = &stub_;
+
+  // records drain() is done with, for producers to reuse. a producer takes
+  // the lot at once rather than popping one, which can't suffer ABA.
+  std::atomic<Record *> free_{nullptr};
+
+  void push(Record *record) {
+    record->next.store(nullptr, std::memory_order_relaxed);
+    auto *prev = head_.exchange(record, std::memory_order_acq_rel);
+    prev->next.store(record, std::memory_order_release);
+  }
+
+  Record *pop() {
+    auto *tail = tail_;
+    auto *next = tail->next.load(std::memory_order_acquire);
+    if (tail == &stub_) {
+      if (!next) return nullptr;
+      tail_ = tail = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+    if (next) {
+      tail_ = next;
+      return tail;
+    }
+    // tail is the last record, unless a push is between its exchange and
+    // linking it in, in which case that record isn't ready yet
+    if (tail != head_.load(std::memory_order_acquire)) return nullptr;
+    push(&stub_);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next) {
+      tail_ = next;
+      return tail;
+    }
+    return nullptr;
+  }
+
+  void release(Record *record) {
+    auto *head = free_.load(std::memory_order_relaxed);
+    do {
+      record->next.store(head, std::memory_order_relaxed);
+    } while (!free_.compare_exchange_weak(head, record,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed));
+  }
+
+  static void deleteList(Record *record) {
+    while (record) {
+      auto *next = record->next.load(std::memory_order_relaxed);
+      delete record;
+      record = next;
+    }
+  }
+
+public:
+  /// Encodes records on one thread. Each thread that encodes needs its own.
+  class Producer {
+    AuMultiProducerEncoder &encoder_;
+    Record *free_ = nullptr; // records taken from the encoder's free list
+
+    Record *take() {
+      if (!free_)
+        free_ = encoder_.free_.exchange(nullptr, std::memory_order_acquire);
+      if (!free_) return new Record;
+      auto *result = free_;
+      free_ = result->next.load(std::memory_order_relaxed);
+      return result;
+    }
+
+    void recycle(Record *record) {
+      record->next.store(free_, std::memory_order_relaxed);
+      free_ = record;
+    }
+
+  public:
+    explicit Producer(AuMultiProducerEncoder &encoder) : encoder_(encoder) {}
+    Producer(const Producer &) = delete;
+    Producer &operator=(const Producer &) = delete;
+
+    ~Producer() {
+      while (free_) {
+        auto *next = free_->next.load(std::memory_order_relaxed);
+        encoder_.release(free_);
+        free_ = next;
+      }
+    }
+
+    /// Encodes a record, as AuEncoder::encode() would, and queues it for the
+    /// writer.
+    template<typename F>
+    void encode(F &&f) {
+      // the record is on no list until it's pushed, so it goes back on ours
+      // unless it is, including if f throws
+      struct Taken {
+        Producer &producer;
+        Record *record;
+        ~Taken() {
+          if (record) producer.recycle(record);
+        }
+      } taken{*this, take()};
+      auto *record = taken.record;
+      record->buf.clear();
+      record->deferred.clear();
+      AuWriter writer(record->buf, record->deferred);
+      f(writer);
+      if (record->buf.tellp() == 0) return;
+      encoder_.push(record);
+      taken.record = nullptr;
+    }
+  };
+
+  /// Takes the same arguments as AuEncoder's constructor.
+  template<typename... Args>
+  explicit AuMultiProducerEncoder(Args &&... args)
+      : encoder_(std::forward<Args>(args)...) {}
+
+  AuMultiProducerEncoder(const AuMultiProducerEncoder &) = delete;
+  AuMultiProducerEncoder &operator=(const AuMultiProducerEncoder &) = delete;
+
+  /// Records still queued are dropped: drain() first. All Producers must
+  /// have been destroyed.
+  ~AuMultiProducerEncoder() {
+    while (auto *record = pop()) delete record;
+    deleteList(free_.load(std::memory_order_acquire));
+  }
+
+  Producer producer() { return Producer(*this); }
+
+  /// Writes every record that's been queued, passing write() the same
+  /// arguments as AuEncoder::encode() does. Call from one thread at a time.
+  /// @return the number of records written
+  template<typename W>
+  size_t drain(W &&write) {
+    size_t records = 0;
+    while (auto *record = pop()) {
+      encoder_.encodeDeferred(record->buf.str(), record->deferred, write);
+      release(record);
+      records++;
+    }
+    return records;
+  }
+
+  /// As AuEncoder::getStats(), from the writer's thread.
+  auto getStats() const { return encoder_.getStats(); }
+};
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+/// An append-only list of strings, stored end to end in large slabs rather
+/// than each in its own allocation. The strings never move, so views of them
+/// stay valid until clear(). clear() keeps the slabs for reuse, so it costs
+/// nothing like freeing each string would.
+class AuStringStore {
+  static constexpr size_t SlabSize = 256 * 1024;
+
+  struct Slab {
+    std::unique_ptr<char[]> data;
+    size_t size;
+  };
+
+  std::vector<Slab> slabs_;
+  size_t slab_ = 0; // the slab being filled
+  size_t used_ = 0; // bytes of it filled
+  std::vector<std::string_view> strings_;
+
+  char *allocate(size_t len) {
+    while (slab_ < slabs_.size() && used_ + len > slabs_[slab_].size) {
+      slab_++;
+      used_ = 0;
+    }
+    if (slab_ == slabs_.size()) {
+      auto size = std::max(SlabSize, len);
+      slabs_.push_back(Slab{std::make_unique<char[]>(size), size});
+    }
+    auto *result = slabs_[slab_].data.get() + used_;
+    used_ += len;
+    return result;
+  }
+
+public:
+  using const_iterator = std::vector<std::string_view>::const_iterator;
+
+  AuStringStore() = default;
+  AuStringStore(AuStringStore &&) = default;
+  AuStringStore &operator=(AuStringStore &&) = default;
+  AuStringStore(const AuStringStore &) = delete;
+  AuStringStore &operator=(const AuStringStore &) = delete;
+
+  /// Copies str to the end of the list, returning the stored copy.
+  std::string_view push_back(std::string_view str) {
+    auto *data = allocate(str.size());
+    if (!str.empty()) ::memcpy(data, str.data(), str.size());
+    return strings_.emplace_back(data, str.size());
+  }
+
+  void reserve(size_t numStrings) { strings_.reserve(numStrings); }
+
+  void clear() {
+    strings_.clear();
+    slab_ = 0;
+    used_ = 0;
+  }
+
+  std::string_view operator[](size_t idx) const { return strings_[idx]; }
+  std::string_view back() const { return strings_.back(); }
+  size_t size() const { return strings_.size(); }
+  bool empty() const { return strings_.empty(); }
+  const_iterator begin() const { return strings_.begin(); }
+  const_iterator end() const { return strings_.end(); }
+};
@@ -2,13 +2,26 @@
 
 #include "au/AuCommon.h"
 
+#include <csignal>
 #include <functional>
 #include <iostream>
 #include <string>
 #include <unordered_map>
+#include <unistd.h>
 
 namespace {
 
+/// Input files are memory-mapped (see MmapByteSource), so one that's
+/// truncated while being read, e.g. by logrotate's copytruncate, raises
+/// SIGBUS. Say so, rather than dying with just "Bus error".
+void onSigbus(int) {
+  static const char msg[] =
+      "au: bus error (was an input file truncated while being read?)\n";
+  // nothing to be done if this fails
+  (void)!::write(STDERR_FILENO, msg, sizeof(msg) - 1);
+  ::_exit(1);
+}
+
 int version(int, char **) {
   std::cout << "au version " << AU_VERSION
             << " (encodes/decodes format version "
@@ -27,10 +40,11 @@ int help(int, char **) {
     << "   cat      Decode listed files to stdout (alias au2json)\n"
     << "   tail     Decode and/or follow file\n"
     << "   grep     Find records matching pattern\n"
-    << "   zgrep    grep in gzipped file\n"
+    << "   zgrep    grep in gzipped or seekable zstd file\n"
     << "   enc      Encode listed files to stdout (alias json2au)\n"
     << "   stats    Display file statistics\n"
-    << "   zindex   Build an index of a gzipped au file\n";
+    << "   zindex   Build an index of a gzipped au file\n"
+    << "   index    Build an index of an au file's dictionaries\n";
   return 0;
 }
 
@@ -54,6 +68,9 @@ int main(int argc, char **argv) {
   commands["stats"] = stats;
   commands["zindex"] = zindex;
   commands["zgrep"] = zgrep;
+  commands["index"] = dictIndex;
+
+  std::signal(SIGBUS, onSigbus);
 
   std::string cmd(argv[1]);
   auto it = commands.find(cmd);
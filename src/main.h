@@ -9,3 +9,4 @@ int zgrep(int argc, const char * const *argv);
 int tail(int argc, const char * const *argv);
 int cat(int argc, const char * const *argv);
 int zindex(int argc, const char * const *argv);
+int dictIndex(int argc, const char * const *argv);
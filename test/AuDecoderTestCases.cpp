@@ -21,4 +21,54 @@ TEST(AuDecoderTestCases, doesntCrashOnCases) {
       auDecoder.decode(recordHandler, false);
     } catch (const std::exception &) {}
   }
-}
\ No newline at end of file
+}
+
+TEST(AuDecoderTestCases, mmapSourceMatchesBufferedSource) {
+  for (auto &p: fs::directory_iterator("cases")) {
+    SCOPED_TRACE(std::string("Processing ") + p.path().c_str());
+    FileByteSourceImpl buffered(p.path(), false);
+    MmapByteSource mapped(p.path());
+    ASSERT_EQ(buffered.endPos(), mapped.endPos());
+
+    std::string fromBuffered, fromMapped;
+    for (auto b = buffered.next(); !b.isEof(); b = buffered.next())
+      fromBuffered.push_back(b.charValue());
+    size_t fragments = 0;
+    mapped.read(mapped.endPos(), [&](std::string_view frag) {
+      fromMapped.append(frag);
+      fragments++;
+    });
+    EXPECT_EQ(fromBuffered, fromMapped);
+    EXPECT_EQ(1, fragments);
+    EXPECT_TRUE(mapped.peek().isEof());
+
+    mapped.seek(mapped.endPos() / 2);
+    EXPECT_EQ(mapped.endPos() / 2, mapped.pos());
+    EXPECT_EQ(fromBuffered[mapped.endPos() / 2], mapped.next().charValue());
+  }
+}
+
+TEST(AuDecoderTestCases, readAheadSourceMatchesBufferedSource) {
+  for (auto &p: fs::directory_iterator("cases")) {
+    SCOPED_TRACE(std::string("Processing ") + p.path().c_str());
+    FileByteSourceImpl buffered(p.path(), false);
+    // tiny buffer and chunks so reads cross plenty of chunk boundaries
+    ReadAheadByteSource readAhead(p.path(), 1, 1, 2);
+    ASSERT_EQ(buffered.endPos(), readAhead.endPos());
+
+    std::string fromBuffered, fromReadAhead;
+    for (auto b = buffered.next(); !b.isEof(); b = buffered.next())
+      fromBuffered.push_back(b.charValue());
+    for (auto b = readAhead.next(); !b.isEof(); b = readAhead.next())
+      fromReadAhead.push_back(b.charValue());
+    EXPECT_EQ(fromBuffered, fromReadAhead);
+
+    if (fromBuffered.empty()) continue;
+    for (auto pos : {fromBuffered.size() / 3, size_t(0),
+                     fromBuffered.size() - 1}) {
+      readAhead.seek(pos);
+      EXPECT_EQ(pos, readAhead.pos());
+      EXPECT_EQ(fromBuffered[pos], readAhead.next().charValue());
+    }
+  }
+}
@@ -1,3 +1,4 @@
+#include "Dictionary.h"
 #include "JsonOutputHandler.h"
 
 #include "gtest/gtest.h"
@@ -7,4 +8,29 @@ TEST(JsonOutputHandler, Time) {
   JsonOutputHandler json;
   json.onTime(0, system_clock::time_point() + nanoseconds(123'456'789));
   EXPECT_EQ(json.str(), R"("1970-01-01T00:00:00.123456789")");
-}
\ No newline at end of file
+}
+
+TEST(Dictionary, RecyclesOldestAndSearchesByPosition) {
+  Dictionary dictionary(3);
+  // dicts starting at 100, 300, 200 (as if bisecting), each with an add
+  for (size_t start : {100, 300, 200}) {
+    auto &dict = dictionary.clear(start);
+    dict.add(start + 50, std::to_string(start));
+  }
+  EXPECT_EQ(200, dictionary.latest()->startPos_);
+  EXPECT_EQ(nullptr, dictionary.search(99));
+  EXPECT_EQ("100", dictionary.search(150)->at(0));
+  EXPECT_EQ(nullptr, dictionary.search(151));
+  EXPECT_EQ("200", dictionary.search(200)->at(0));
+  EXPECT_EQ("300", dictionary.search(349)->at(0));
+  EXPECT_EQ(&dictionary.clear(300), dictionary.search(300));
+
+  // replaces the oldest, the one at 100
+  auto &dict = dictionary.clear(400);
+  EXPECT_EQ(0, dict.size());
+  EXPECT_EQ(&dict, dictionary.latest());
+  EXPECT_EQ(nullptr, dictionary.search(150));
+  EXPECT_EQ("300", dictionary.search(320)->at(0));
+  EXPECT_EQ(&dict, dictionary.search(400));
+  EXPECT_THROW(dictionary.clear(310), parse_error);
+}
@@ -1,15 +1,28 @@
+#include "au/AuAsyncWriter.h"
+#include "au/AuBatchWriter.h"
 #include "au/AuEncoder.h"
 #include "au/AuDecoder.h"
+#include "au/AuMultiProducerEncoder.h"
+#include "ZstdByteSource.h"
 
 #include <gmock/gmock.h>
 
 #include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
 #include <iostream>
+#include <map>
 #include <sstream>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <vector>
 
+#ifdef AU_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
 using namespace std::literals;
 
 TEST(AuStringIntern, NoIntern) {
@@ -81,6 +94,55 @@ TEST(AuStringIntern, ReIndex) {
   EXPECT_EQ(2, *si.idx("quadrice"s, true));
 }
 
+TEST(AuStringIntern, ClearAndReuse) {
+  AuStringIntern si(1, 2, 10);
+  auto &dict = si.dict();
+  for (int i = 0; i < 1000; i++)
+    EXPECT_EQ(i, *si.idx("string " + std::to_string(i), true));
+  si.clear(false);
+  EXPECT_EQ(0, dict.size());
+  EXPECT_EQ(0, *si.idx("string 999"s, true));
+  EXPECT_EQ(1, *si.idx("string 0"s, true));
+  EXPECT_EQ(0, *si.idx("string 999"s, true));
+  EXPECT_EQ("string 999"s, dict[0]);
+}
+
+TEST(AuStringStore, ViewsStayValid) {
+  AuStringStore store;
+  std::vector<std::string> expected;
+  std::vector<std::string_view> views;
+  for (int i = 0; i < 100000; i++) {
+    expected.push_back(std::string(i % 100, 'x') + std::to_string(i));
+    views.push_back(store.push_back(expected.back()));
+  }
+  // bigger than a slab
+  expected.emplace_back(1024 * 1024, 'y');
+  views.push_back(store.push_back(expected.back()));
+  expected.emplace_back();
+  views.push_back(store.push_back(expected.back()));
+
+  ASSERT_EQ(expected.size(), store.size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    EXPECT_EQ(expected[i], views[i]);
+    EXPECT_EQ(expected[i], store[i]);
+  }
+
+  store.clear();
+  EXPECT_TRUE(store.empty());
+  EXPECT_EQ("again"sv, store.push_back("again"));
+  EXPECT_EQ("again"sv, store[0]);
+}
+
+TEST(AuVectorBuffer, ReserveAndCommit) {
+  AuVectorBuffer buf(4);
+  buf.put('a');
+  auto *p = buf.reserve(10); // past the initial capacity
+  std::memcpy(p, "bcd", 3);
+  buf.commit(p + 3);
+  buf.write("efgh", 4);
+  EXPECT_EQ("abcdefgh"sv, buf.str());
+}
+
 struct AuFormatterTest : public ::testing::Test {
   AuVectorBuffer buf;
   AuStringIntern stringIntern;
@@ -273,7 +335,409 @@ TEST_F(AuFormatterTest, NestedArray) {
   EXPECT_EQ(std::string("\x0b\x61\x62\x0b\x63\x64\x0c\x0c"), buf.str());
 }
 
+TEST(AuKey, EncodesAsStringKeysDo) {
+  static constexpr AuKey Ts("ts"); // too short to intern
+  static constexpr AuKey Price("price");
+  static constexpr AuKey Quantity("quantity");
+  static_assert(Price.str() == "price");
+
+  auto encodeAll = [](auto &&record) {
+    std::string result;
+    // reindexing and clearing every so often, so cached keys go stale
+    AuEncoder encoder("", 7, 2, 11, 20);
+    for (size_t i = 0; i < 200; i++) {
+      encoder.encode([&](AuWriter &writer) { record(writer, i); },
+                     [&](std::string_view dict, std::string_view value) {
+                       result.append(dict).append(value);
+                       return 0;
+                     });
+    }
+    return result;
+  };
+
+  auto expected = encodeAll([](AuWriter &writer, size_t i) {
+    writer.map("field" + std::to_string(i % 30), i, "ts", i, "price", 1.5,
+               "quantity", i % 5);
+  });
+  auto actual = encodeAll([](AuWriter &writer, size_t i) {
+    writer.map("field" + std::to_string(i % 30), i, Ts, i, Price, 1.5,
+               Quantity, i % 5);
+  });
+  EXPECT_EQ(expected, actual);
+}
+
 TEST(AuEncoder, creation) {
   AuEncoder au();
 }
 
+
+TEST(AuMultiProducerEncoder, OneProducerMatchesAuEncoder) {
+  auto record = [](AuWriter &writer, size_t i) {
+    writer.startMap();
+    writer.key("frequent key");
+    writer.value("a value that's interned once it's common");
+    // enough of them to clear the dictionary now and then
+    writer.key("key" + std::to_string(i % 30));
+    writer.value(i);
+    writer.key("inline");
+    writer.value("never interned", false);
+    writer.endMap();
+  };
+  auto append = [](std::string &out) {
+    return [&out](std::string_view dict, std::string_view value) {
+      out.append(dict).append(value);
+      return 0;
+    };
+  };
+
+  std::string expected;
+  AuEncoder encoder("meta", 0, 50, 0, 20);
+  for (size_t i = 0; i < 100; i++)
+    encoder.encode([&](AuWriter &writer) { record(writer, i); },
+                   append(expected));
+
+  std::string actual;
+  AuMultiProducerEncoder mpEncoder("meta", 0, 50, 0, 20);
+  auto producer = mpEncoder.producer();
+  for (size_t i = 0; i < 100; i++) {
+    producer.encode([&](AuWriter &writer) { record(writer, i); });
+    if (i % 7 == 0) mpEncoder.drain(append(actual));
+  }
+  producer.encode([](AuWriter &) {}); // not a record
+  mpEncoder.drain(append(actual));
+
+  EXPECT_EQ(expected, actual);
+}
+
+TEST(AuMultiProducerEncoder, CallbackThrows) {
+  auto record = [](AuWriter &writer) {
+    writer.map("key", "a value", "other key", 1234);
+  };
+  std::string expected;
+  AuEncoder encoder("meta");
+  encoder.encode(record, [&](std::string_view dict, std::string_view value) {
+    expected.append(dict).append(value);
+    return 0;
+  });
+
+  std::string actual;
+  AuMultiProducerEncoder mpEncoder("meta");
+  auto producer = mpEncoder.producer();
+  EXPECT_THROW(producer.encode([](AuWriter &writer) {
+                 writer.startMap();
+                 writer.key("abandoned");
+                 throw std::runtime_error("oops");
+               }),
+               std::runtime_error);
+  producer.encode(record);
+  EXPECT_EQ(1, mpEncoder.drain([&](std::string_view dict,
+                                   std::string_view value) {
+    actual.append(dict).append(value);
+    return 0;
+  }));
+  EXPECT_EQ(expected, actual);
+}
+
+TEST(AuMultiProducerEncoder, ManyProducers) {
+  constexpr size_t Threads = 4;
+  constexpr size_t Records = 5000;
+  auto record = [](AuWriter &writer, size_t thread, size_t i) {
+    writer.map("t", thread, "i", i);
+  };
+
+  // what each record's value looks like, to tell which it was
+  std::map<std::string, std::pair<size_t, size_t>> records;
+  for (size_t thread = 0; thread < Threads; thread++) {
+    for (size_t i = 0; i < Records; i++) {
+      AuVectorBuffer buf;
+      AuStringIntern stringIntern;
+      AuWriter writer(buf, stringIntern);
+      record(writer, thread, i);
+      std::string str(buf.str());
+      str += static_cast<char>(marker::RecordEnd);
+      str += '\n';
+      records[str] = {thread, i};
+    }
+  }
+
+  AuMultiProducerEncoder mpEncoder;
+  std::vector<std::thread> threads;
+  for (size_t thread = 0; thread < Threads; thread++) {
+    threads.emplace_back([&, thread] {
+      auto producer = mpEncoder.producer();
+      for (size_t i = 0; i < Records; i++)
+        producer.encode(
+            [&](AuWriter &writer) { record(writer, thread, i); });
+    });
+  }
+
+  std::vector<size_t> next(Threads);
+  size_t written = 0;
+  auto check = [&](std::string_view, std::string_view value) {
+    auto it = records.find(std::string(value));
+    EXPECT_NE(records.end(), it);
+    if (it != records.end()) {
+      auto [thread, i] = it->second;
+      EXPECT_EQ(next[thread]++, i);
+    }
+    return 0;
+  };
+  while (written < Threads * Records) {
+    written += mpEncoder.drain(check);
+    std::this_thread::yield();
+  }
+  for (auto &thread : threads) thread.join();
+  EXPECT_EQ(0, mpEncoder.drain(check));
+  EXPECT_EQ(std::vector<size_t>(Threads, Records), next);
+}
+
+namespace {
+
+std::string readAll(FILE *file) {
+  std::string result;
+  char buf[4096];
+  ::rewind(file);
+  while (auto n = ::fread(buf, 1, sizeof(buf), file)) result.append(buf, n);
+  return result;
+}
+
+}
+
+TEST(AuAsyncWriter, WritesWhatAuEncoderWould) {
+  auto record = [](AuWriter &writer, size_t i) {
+    writer.map("key" + std::to_string(i % 100), i,
+               "padding", std::string(i % 1000, 'x'));
+  };
+
+  std::string expected;
+  AuEncoder encoder("meta");
+  for (size_t i = 0; i < 20000; i++)
+    encoder.encode([&](AuWriter &writer) { record(writer, i); },
+                   [&](std::string_view dict, std::string_view value) {
+                     expected.append(dict).append(value);
+                     return 0;
+                   });
+
+  std::unique_ptr<FILE, decltype(&::fclose)> file(::tmpfile(), &::fclose);
+  ASSERT_TRUE(file);
+  AuAsyncWriterOptions options;
+  options.batchSize = 100 * 1024; // many batches, most part way into a chunk
+  options.maxBuffered = 300 * 1024;
+  AuAsyncWriter writer(::fileno(file.get()), options);
+  AuEncoder asyncEncoder("meta");
+  for (size_t i = 0; i < 20000; i++) {
+    asyncEncoder.encode([&](AuWriter &w) { record(w, i); }, writer);
+    if (i == 10000) {
+      writer.flush();
+      EXPECT_EQ(expected.substr(0, readAll(file.get()).size()),
+                readAll(file.get()));
+    }
+  }
+  writer.close();
+  EXPECT_EQ(expected, readAll(file.get()));
+  EXPECT_THROW(writer("", "more"), std::runtime_error);
+}
+
+TEST(AuAsyncWriter, WritesAfterMaxDelay) {
+  std::unique_ptr<FILE, decltype(&::fclose)> file(::tmpfile(), &::fclose);
+  ASSERT_TRUE(file);
+  AuAsyncWriterOptions options;
+  options.maxDelay = std::chrono::milliseconds(10);
+  AuAsyncWriter writer(::fileno(file.get()), options);
+  writer("dict", "value");
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (readAll(file.get()).empty()
+         && std::chrono::steady_clock::now() < deadline)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  EXPECT_EQ("dictvalue", readAll(file.get()));
+}
+
+TEST(AuAsyncWriter, ReportsErrors) {
+  int fd = ::open("/dev/null", O_RDONLY);
+  ASSERT_NE(-1, fd);
+  AuAsyncWriter writer(fd);
+  writer("dict", "value");
+  EXPECT_THROW(writer.flush(), std::runtime_error);
+  EXPECT_THROW(writer("dict", "value"), std::runtime_error);
+  ::close(fd);
+}
+
+TEST(AuBatchWriter, WritesWhatAuEncoderWould) {
+  // values either side of the size that's written without being copied
+  auto record = [](AuWriter &writer, size_t i) {
+    writer.map("key" + std::to_string(i % 100), i,
+               "padding", std::string(i % 7 == 0 ? 20000 : i % 1000, 'x'));
+  };
+
+  std::string expected;
+  AuEncoder encoder("meta");
+  for (size_t i = 0; i < 5000; i++)
+    encoder.encode([&](AuWriter &writer) { record(writer, i); },
+                   [&](std::string_view dict, std::string_view value) {
+                     expected.append(dict).append(value);
+                     return 0;
+                   });
+
+  std::unique_ptr<FILE, decltype(&::fclose)> file(::tmpfile(), &::fclose);
+  ASSERT_TRUE(file);
+  AuBatchWriter writer(::fileno(file.get()), 10000);
+  AuEncoder batchEncoder("meta");
+  for (size_t i = 0; i < 5000; i++)
+    batchEncoder.encode([&](AuWriter &w) { record(w, i); }, writer);
+  writer.flush();
+  EXPECT_EQ(expected, readAll(file.get()));
+}
+
+TEST(AuBatchWriter, ReportsErrors) {
+  int fd = ::open("/dev/null", O_RDONLY);
+  ASSERT_NE(-1, fd);
+  AuBatchWriter writer(fd);
+  writer("dict", "value");
+  EXPECT_THROW(writer.flush(), std::runtime_error);
+  EXPECT_THROW(writer("dict", std::string(20000, 'x')), std::runtime_error);
+  ::close(fd);
+}
+
+TEST(MmapByteSource, ThrowsWhenTruncated) {
+  char path[] = "/tmp/auMmapTestXXXXXX";
+  int fd = ::mkstemp(path);
+  ASSERT_NE(-1, fd);
+  std::string file;
+  AuEncoder encoder("meta");
+  for (size_t i = 0; i < 10000; i++)
+    encoder.encode([&](AuWriter &writer) {
+                     writer.map("key", i, "padding",
+                                std::to_string(i) + std::string(100, 'x'));
+                   },
+                   [&](std::string_view dict, std::string_view value) {
+                     file.append(dict).append(value);
+                     return 0;
+                   });
+  ASSERT_EQ(ssize_t(file.size()), ::write(fd, file.data(), file.size()));
+  ASSERT_GT(file.size(), 1024 * 1024);
+
+  struct Handler : NoopRecordHandler<Handler> {};
+  Handler handler;
+  // the truncation is noticed as the next window is handed out. touching
+  // what's gone before then would raise SIGBUS, hence the small window.
+  MmapByteSource source(path, false, 64);
+  RecordParser<Handler> parser(source, handler);
+  EXPECT_TRUE(parser.parseUntilValue());
+  ASSERT_EQ(0, ::ftruncate(fd, 512 * 1024));
+  EXPECT_THROW(parser.parseStream(), parse_error);
+  EXPECT_THROW(source.seek(file.size() - 1), parse_error);
+
+  ::close(fd);
+  ::unlink(path);
+}
+
+namespace {
+
+/// Points stdin at fd for as long as it lives.
+class RedirectStdin {
+  int saved_;
+
+public:
+  explicit RedirectStdin(int fd) : saved_(::dup(STDIN_FILENO)) {
+    ::dup2(fd, STDIN_FILENO);
+  }
+  ~RedirectStdin() {
+    ::dup2(saved_, STDIN_FILENO);
+    ::close(saved_);
+  }
+};
+
+}
+
+TEST(ReadAheadByteSource, PositionsAreFileOffsets) {
+  std::unique_ptr<FILE, decltype(&::fclose)> file(::tmpfile(), &::fclose);
+  ASSERT_TRUE(file);
+  std::string contents = "0123456789abcdefghijklmnopqrstuvwxyz";
+  ::fputs(contents.c_str(), file.get());
+  ::fflush(file.get());
+  ::lseek(::fileno(file.get()), 10, SEEK_SET);
+
+  RedirectStdin redirect(::fileno(file.get()));
+  auto source = openFileByteSource("-", false, true);
+  ASSERT_TRUE(dynamic_cast<ReadAheadByteSource *>(source.get()));
+  EXPECT_EQ(10, source->pos());
+  EXPECT_EQ('a', source->next().charValue());
+  source->seek(30);
+  EXPECT_EQ(30, source->pos());
+  EXPECT_EQ('u', source->next().charValue());
+  EXPECT_EQ(contents.size(), source->endPos());
+}
+
+TEST(ReadAheadByteSource, NotUsedForPipes) {
+  int fds[2];
+  ASSERT_EQ(0, ::pipe(fds));
+  {
+    RedirectStdin redirect(fds[0]);
+    // the pipe never produces anything, so a source reading ahead on it
+    // couldn't be destroyed
+    auto source = openFileByteSource("-", false, true);
+    EXPECT_FALSE(dynamic_cast<ReadAheadByteSource *>(source.get()));
+  }
+  ::close(fds[0]);
+  ::close(fds[1]);
+}
+
+#ifdef AU_HAVE_ZSTD
+TEST(ZstdByteSource, ReadsFinalFrameInSmallPieces) {
+  std::string contents;
+  for (size_t i = 0; contents.size() < 300 * 1024; i++)
+    contents += "line " + std::to_string(i * i) + "\n";
+
+  // two frames, without content checksums, then the seek table
+  std::string file;
+  auto le32 = [&](uint32_t v) {
+    for (int i = 0; i < 4; i++) file += static_cast<char>(v >> (8 * i));
+  };
+  std::vector<std::pair<uint32_t, uint32_t>> sizes;
+  size_t split = 100 * 1024;
+  for (auto frame : {std::string_view(contents).substr(0, split),
+                     std::string_view(contents).substr(split)}) {
+    std::string compressed(ZSTD_compressBound(frame.size()), '\0');
+    auto n = ZSTD_compress(compressed.data(), compressed.size(),
+                           frame.data(), frame.size(), 1);
+    ASSERT_FALSE(ZSTD_isError(n));
+    file.append(compressed, 0, n);
+    sizes.emplace_back(n, frame.size());
+  }
+  le32(0x184D2A5E);
+  le32(sizes.size() * 8 + 9);
+  for (auto &[compressed, uncompressed] : sizes) {
+    le32(compressed);
+    le32(uncompressed);
+  }
+  le32(sizes.size());
+  file += '\0';
+  le32(0x8F92EAB1);
+
+  char path[] = "/tmp/auZstdTestXXXXXX";
+  int fd = ::mkstemp(path);
+  ASSERT_NE(-1, fd);
+  ASSERT_EQ(ssize_t(file.size()), ::write(fd, file.data(), file.size()));
+  ::close(fd);
+
+  ASSERT_TRUE(ZstdByteSource::isSeekableZstd(path));
+  ZstdByteSource source(path);
+  EXPECT_EQ(contents.size(), source.endPos());
+  EXPECT_EQ((std::vector<size_t>{0, split, contents.size()}),
+            source.accessPoints());
+
+  std::string read;
+  char buf[1000];
+  while (auto n = source.doRead(buf, sizeof(buf))) read.append(buf, n);
+  EXPECT_EQ(contents, read);
+
+  // skipping deep into the last frame decodes it 32KiB at a time
+  auto pos = contents.size() - 100;
+  source.doSeek(pos);
+  read.clear();
+  while (auto n = source.doRead(buf, sizeof(buf))) read.append(buf, n);
+  EXPECT_EQ(contents.substr(pos), read);
+
+  ::unlink(path);
+}
+#endif